@@ -0,0 +1,110 @@
+/****************************************************************************
+ * Microbenchmarks of libtwobit
+ *
+ * Compiled by run_benchmarks.R with R CMD SHLIB against the libtwobit.a
+ * and header files installed with Rtwobitlib (like any package that links
+ * to Rtwobitlib would do) and called with .Call(). The timing is done at
+ * the R level. Each function returns the number of times it did the thing
+ * it benchmarks (files opened, bases decoded) so the throughput can be
+ * computed.
+ */
+#include <Rdefines.h>
+
+#include <kent/dnaseq.h>  /* for dnaSeqFree() */
+#include <kent/twoBit.h>
+
+static struct twoBitFile *open_2bit_file(SEXP filepath, SEXP mmap)
+{
+	const char *path = CHAR(STRING_ELT(filepath, 0));
+
+	return LOGICAL(mmap)[0] ? twoBitOpenMmap(path) : twoBitOpen(path);
+}
+
+/* --- .Call ENTRY POINT --- */
+SEXP bench_twoBitOpen(SEXP filepath, SEXP times, SEXP mmap)
+{
+	struct twoBitFile *tbf;
+	int n = INTEGER(times)[0], i;
+
+	for (i = 0; i < n; i++) {
+		tbf = open_2bit_file(filepath, mmap);
+		twoBitClose(&tbf);
+	}
+	return ScalarInteger(n);
+}
+
+/* xorshift64, to get the same random fragments on all platforms. */
+static unsigned long long next_random(unsigned long long *state)
+{
+	*state ^= *state << 13;
+	*state ^= *state >> 7;
+	*state ^= *state << 17;
+	return *state;
+}
+
+/* Reads 'nfrag' fragments of 'width' bases (or less at the end of the
+   sequences) with twoBitReadSeqFragExt(). Sequential fragments tile the
+   sequences in the order of the file, starting again with the first
+   sequence if 'nfrag' is more than it takes to cover them all. Random
+   fragments are on sequences picked with a probability proportional to
+   their length. */
+/* --- .Call ENTRY POINT --- */
+SEXP bench_twoBitReadSeqFragExt(SEXP filepath, SEXP width, SEXP nfrag,
+				SEXP random, SEXP mmap)
+{
+	struct twoBitFile *tbf;
+	struct twoBitIndex *index, **indices;
+	struct dnaSeq *seq;
+	long long *cum_sizes, total_size, bases, pos;
+	unsigned long long state = 88172645463325252ULL;
+	int w = INTEGER(width)[0], n = INTEGER(nfrag)[0],
+	    nseq, i, k, lo, hi, start, end;
+
+	tbf = open_2bit_file(filepath, mmap);
+	nseq = tbf->seqCount;
+	indices = (struct twoBitIndex **)
+		R_alloc(nseq, sizeof(struct twoBitIndex *));
+	cum_sizes = (long long *) R_alloc(nseq + 1, sizeof(long long));
+	cum_sizes[0] = 0;
+	for (i = 0, index = tbf->indexList; i < nseq; i++, index = index->next)
+	{
+		indices[i] = index;
+		cum_sizes[i + 1] = cum_sizes[i] +
+				   twoBitSeqSize(tbf, index->name);
+	}
+	total_size = cum_sizes[nseq];
+	if (total_size == 0) {
+		twoBitClose(&tbf);
+		error("all the sequences are empty");
+	}
+
+	bases = 0;
+	pos = 0;
+	for (k = 0; k < n; k++) {
+		if (LOGICAL(random)[0])
+			pos = next_random(&state) % total_size;
+		else if (pos >= total_size)
+			pos = 0;
+		/* Find the sequence that contains 'pos'. */
+		lo = 0;
+		hi = nseq;
+		while (hi - lo > 1) {
+			i = (lo + hi) / 2;
+			if (cum_sizes[i] <= pos)
+				lo = i;
+			else
+				hi = i;
+		}
+		start = pos - cum_sizes[lo];
+		end = start + w;
+		if (end > cum_sizes[lo + 1] - cum_sizes[lo])
+			end = cum_sizes[lo + 1] - cum_sizes[lo];
+		seq = twoBitReadSeqFragExt(tbf, indices[lo]->name,
+					   start, end, TRUE, NULL);
+		bases += seq->size;
+		dnaSeqFree(&seq);
+		pos = cum_sizes[lo] + end;
+	}
+	twoBitClose(&tbf);
+	return ScalarReal((double) bases);
+}
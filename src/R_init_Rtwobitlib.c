@@ -1,15 +1,34 @@
 #include <R_ext/Rdynload.h>
 
 #include "twobit_roundtrip.h"
+#include "twobit_lazy.h"
 #include "twobit_seqstats.h"
+#include "twobit_getseq.h"
+#include "fasta_to_twobit.h"
+#include "twobit_to_fasta.h"
+#include "twobit_io_stats.h"
+#include "twobit_io_callbacks.h"
+#include "twobit_handle.h"
 
 #define CALLMETHOD_DEF(fun, numArgs) {#fun, (DL_FUNC) &fun, numArgs}
 
 static const R_CallMethodDef callMethods[] = {
-	CALLMETHOD_DEF(C_twobit_read, 1),
+	CALLMETHOD_DEF(C_twobit_read, 3),
+	CALLMETHOD_DEF(C_twobit_read_lazy, 1),
 	CALLMETHOD_DEF(C_twobit_write, 4),
 	CALLMETHOD_DEF(C_get_twobit_seqlengths, 1),
-	CALLMETHOD_DEF(C_get_twobit_seqstats, 1),
+	CALLMETHOD_DEF(C_get_twobit_seqstats, 2),
+	CALLMETHOD_DEF(C_twobit_summarize, 1),
+	CALLMETHOD_DEF(C_twobit_getseq, 5),
+	CALLMETHOD_DEF(C_fasta_to_twobit, 4),
+	CALLMETHOD_DEF(C_twobit_to_fasta, 5),
+	CALLMETHOD_DEF(C_twobit_io_stats, 1),
+	CALLMETHOD_DEF(C_set_twobit_time_decode, 1),
+	CALLMETHOD_DEF(C_set_twobit_use_mmap, 1),
+	CALLMETHOD_DEF(C_test_twobit_io_callbacks, 6),
+	CALLMETHOD_DEF(C_twobit_open, 1),
+	CALLMETHOD_DEF(C_twobit_close, 1),
+	CALLMETHOD_DEF(C_get_twobit_handle_info, 1),
 	{NULL, NULL, 0}
 };
 
@@ -17,6 +36,7 @@ void R_init_Rtwobitlib(DllInfo *info)
 {
 	R_registerRoutines(info, NULL, callMethods, NULL, NULL);
 	R_useDynamicSymbols(info, 0);
+	_init_lazy_twobit_class(info);
 	return;
 }
 
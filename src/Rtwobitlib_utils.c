@@ -1,7 +1,14 @@
 #include "Rtwobitlib_utils.h"
+#include "twobit_handle.h"
 
 #include <kent/twoBit.h>
 
+#include <stdio.h>  /* for fclose(), remove() */
+#include <stdlib.h>  /* for qsort() */
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
 const char *_filepath2str(SEXP filepath)
 {
 	SEXP path;
@@ -14,8 +21,212 @@ const char *_filepath2str(SEXP filepath)
 	return CHAR(path);
 }
 
-struct twoBitFile *_open_2bit_file(SEXP filepath)
+/* The .2bit file image in raw vector 'x' is read in place, so 'x' must be
+   kept alive until the file is closed. */
+struct twoBitFile *_open_2bit_raw(SEXP x)
+{
+	return twoBitOpenMem("raw vector", RAW(x), XLENGTH(x));
+}
+
+/* The I/O stats of the last file closed with _close_2bit_file(), and
+   whether the files opened with _open_2bit_file() or
+   _open_2bit_persistent() time decoding and are mapped in memory with
+   twoBitOpenMmap() rather than read with stdio or pread(). The
+   stats of a file that belongs to a twobit_handle are cumulative so we
+   also keep what they were when the current call started. */
+static struct twoBitIOStats last_io_stats, call_start_stats;
+static int time_decode = 0, use_mmap = 0;
+
+/* 'x' is the path to a .2bit file, a raw vector containing one, or a
+   twobit_handle. */
+struct twoBitFile *_open_2bit_file(SEXP x)
+{
+	struct twoBitFile *tbf;
+
+	if (_is_twobit_handle(x)) {
+		tbf = _get_twobit_handle_tbf(x);
+		call_start_stats = tbf->stats;
+	} else {
+		if (TYPEOF(x) == RAWSXP)
+			tbf = _open_2bit_raw(x);
+		else if (use_mmap)
+			tbf = twoBitOpenMmap(_filepath2str(x));
+		else
+			tbf = twoBitOpen(_filepath2str(x));
+		twoBitIOStatsClear(&call_start_stats);
+	}
+	tbf->stats.timeDecode = time_decode;
+	return tbf;
+}
+
+/* For the files that stay open between calls (twobit_handle objects and
+   lazy character vectors) and so can get used in the processes forked by
+   parallel::mclapply(). A path is opened with twoBitOpenPositional() (or
+   twoBitOpenMmap()) rather than with stdio: the reads say where they read
+   from instead of relying on the file offset, which the forked processes
+   share with the parent and with each other. 'x' is the path to a .2bit
+   file or a raw vector containing one. */
+struct twoBitFile *_open_2bit_persistent(SEXP x)
+{
+	struct twoBitFile *tbf;
+
+	if (TYPEOF(x) == RAWSXP)
+		tbf = _open_2bit_raw(x);
+	else if (use_mmap)
+		tbf = twoBitOpenMmap(_filepath2str(x));
+	else
+		tbf = twoBitOpenPositional(_filepath2str(x));
+	tbf->stats.timeDecode = time_decode;
+	return tbf;
+}
+
+/* Must be called on all the paths out of a function that called
+   _open_2bit_file(), error paths included: the file of a twobit_handle
+   stays open. The stats of 'tbf' include those of the readers freed so
+   far so the readers must be freed first. */
+void _close_2bit_file(SEXP x, struct twoBitFile **tbf)
 {
-	return twoBitOpen(_filepath2str(filepath));
+	const struct twoBitIOStats *stats = &(*tbf)->stats,
+				   *start = &call_start_stats;
+
+	last_io_stats.seekCount = stats->seekCount - start->seekCount;
+	last_io_stats.readCount = stats->readCount - start->readCount;
+	last_io_stats.bytesRead = stats->bytesRead - start->bytesRead;
+	last_io_stats.headerHits = stats->headerHits - start->headerHits;
+	last_io_stats.headerMisses = stats->headerMisses -
+				     start->headerMisses;
+	last_io_stats.fragCount = stats->fragCount - start->fragCount;
+	last_io_stats.basesDecoded = stats->basesDecoded -
+				     start->basesDecoded;
+	last_io_stats.decodeNanos = stats->decodeNanos - start->decodeNanos;
+	last_io_stats.timeDecode = stats->timeDecode;
+	if (_is_twobit_handle(x))
+		*tbf = NULL;
+	else
+		twoBitClose(tbf);
+	return;
+}
+
+const struct twoBitIOStats *_get_last_io_stats(void)
+{
+	return &last_io_stats;
+}
+
+/* Returns the previous setting. */
+int _set_time_decode(int on)
+{
+	int prev = time_decode;
+
+	time_decode = on;
+	return prev;
+}
+
+/* Returns the previous setting. */
+int _set_use_mmap(int on)
+{
+	int prev = use_mmap;
+
+	use_mmap = on;
+	return prev;
 }
 
+/* Closes and removes the partially written file at 'path' and raises the
+   error returned by one of the twoBitWriter*() functions. */
+void _abort_twobit_write(FILE *f, const char *path, int ret, int use_long,
+			 const char *msg, const char *caller)
+{
+	fclose(f);
+	remove(path);
+	if (ret != -2 || use_long)
+		error("%s", msg);
+	/* index overflow error */
+	error("%s\nCall %s() again with 'use.long=TRUE'.", msg, caller);
+}
+
+
+/****************************************************************************
+ * Support for processing the sequences of a .2bit file in parallel
+ */
+
+/* 'nthreads' is expected to have been checked at the R level. No more
+   threads than OpenMP uses by default, or than there are tasks to run
+   concurrently, get started (each of them gets its own reader). Without
+   OpenMP support everything runs on the main thread. */
+int _get_nthreads(SEXP nthreads, int ntask)
+{
+#ifdef _OPENMP
+	int n, max_threads;
+
+	n = INTEGER(nthreads)[0];
+	max_threads = omp_get_max_threads();
+	if (n > max_threads)
+		n = max_threads;
+	if (n > ntask)
+		n = ntask;
+	return n >= 1 ? n : 1;
+#else
+	return 1;
+#endif
+}
+
+static int cmp_seq_tasks(const void *p1, const void *p2)
+{
+	const struct seq_task *task1 = p1, *task2 = p2;
+
+	/* Biggest sequences first. */
+	if (task1->size != task2->size)
+		return task1->size > task2->size ? -1 : 1;
+	return task1->i - task2->i;
+}
+
+/* Returns one task per sequence in 'tbf', ordered by decreasing sequence
+   size so the big sequences get started first and the small ones fill
+   the gaps at the end. The array is allocated with R_alloc(). */
+struct seq_task *_make_seq_tasks(SEXP x, struct twoBitFile *tbf,
+				 const char *caller)
+{
+	struct seq_task *tasks;
+	struct twoBitIndex *index;
+	int i;
+
+	tasks = (struct seq_task *)
+		R_alloc(tbf->seqCount, sizeof(struct seq_task));
+	for (i = 0, index = tbf->indexList;
+	     i < tbf->seqCount;
+	     i++, index = index->next)
+	{
+		if (index == NULL) {  /* should never happen */
+			_close_2bit_file(x, &tbf);
+			error("Rtwobitlib internal error in %s():\n"
+			      "    index == NULL", caller);
+		}
+		tasks[i].index = index;
+		tasks[i].i = i;
+		/* twoBitSeqSize() does not load the sequence data in memory. */
+		tasks[i].size = twoBitSeqSize(tbf, index->name);
+	}
+	qsort(tasks, tbf->seqCount, sizeof(struct seq_task), cmp_seq_tasks);
+	return tasks;
+}
+
+/* One reader per thread. Must be called from the main thread. */
+struct twoBitReader **_new_twoBitReaders(struct twoBitFile *tbf, int n)
+{
+	struct twoBitReader **readers;
+	int t;
+
+	readers = (struct twoBitReader **)
+		R_alloc(n, sizeof(struct twoBitReader *));
+	for (t = 0; t < n; t++)
+		readers[t] = twoBitReaderNew(tbf);
+	return readers;
+}
+
+void _free_twoBitReaders(struct twoBitReader **readers, int n)
+{
+	int t;
+
+	for (t = 0; t < n; t++)
+		twoBitReaderFree(readers + t);
+	return;
+}
@@ -5,9 +5,39 @@
 
 #include <kent/twoBit.h>
 
+/* One sequence of a .2bit file to process. */
+struct seq_task {
+	struct twoBitIndex *index;
+	int i;     /* rank of the sequence in the file index */
+	int size;  /* length of the sequence */
+};
+
 const char *_filepath2str(SEXP filepath);
 
-struct twoBitFile *_open_2bit_file(SEXP filepath);
+struct twoBitFile *_open_2bit_raw(SEXP x);
 
-#endif  /* _RTWOBITLIB_UTILS_H_ */
+struct twoBitFile *_open_2bit_file(SEXP x);
+
+struct twoBitFile *_open_2bit_persistent(SEXP x);
+
+void _close_2bit_file(SEXP x, struct twoBitFile **tbf);
+
+const struct twoBitIOStats *_get_last_io_stats(void);
+
+int _set_time_decode(int on);
+
+int _set_use_mmap(int on);
 
+void _abort_twobit_write(FILE *f, const char *path, int ret, int use_long,
+			 const char *msg, const char *caller);
+
+int _get_nthreads(SEXP nthreads, int ntask);
+
+struct seq_task *_make_seq_tasks(SEXP x, struct twoBitFile *tbf,
+				 const char *caller);
+
+struct twoBitReader **_new_twoBitReaders(struct twoBitFile *tbf, int n);
+
+void _free_twoBitReaders(struct twoBitReader **readers, int n);
+
+#endif  /* _RTWOBITLIB_UTILS_H_ */
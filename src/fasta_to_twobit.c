@@ -0,0 +1,427 @@
+#include "fasta_to_twobit.h"
+#include "Rtwobitlib_utils.h"
+
+#include <kent/hash.h> /* for newHash(), freeHash(), hashLookup(), hashAdd() */
+#include <kent/twoBit.h>
+
+#include <zlib.h>  /* for gzopen(), gzread(), gzclose() */
+#include <stdio.h>  /* for fopen(), fclose() */
+#include <string.h>  /* for strerror(), memcpy(), memset(), memchr() */
+#include <ctype.h>  /* for isspace(), isalpha() */
+#include <limits.h>  /* for INT_MAX */
+#include <errno.h>
+
+
+/****************************************************************************
+ * Reading the FASTA file
+ *
+ * The file is read with zlib so gzip-compressed and uncompressed FASTA
+ * files are supported transparently. Only the Rtwobitlib.so glue code uses
+ * zlib, libtwobit doesn't.
+ *
+ * The sequence lines are not read whole: they are returned in pieces of at
+ * most FASTA_BUF_SIZE bytes so memory use does not depend on the length of
+ * the lines (a sequence can be on a single line of any length).
+ */
+
+#define FASTA_BUF_SIZE (128 * 1024)
+
+/* What next_fasta_piece() returns. */
+#define FASTA_EOF	0
+#define FASTA_HEADER	1  /* a whole header line (maybe truncated) */
+#define FASTA_SEQ	2  /* a piece of a sequence line */
+
+struct fasta_input {
+	const char *path;
+	gzFile gz;
+	char *buf;      /* FASTA_BUF_SIZE bytes read from the file */
+	int pos, end;   /* unread bytes of 'buf' */
+	char *header;   /* the last header line */
+	int line_no;    /* number of the line of the last piece (1-based) */
+	int at_bol;     /* 1 if the next byte starts a new line */
+};
+
+static void close_fasta_file(struct fasta_input *input)
+{
+	gzclose(input->gz);
+	input->gz = NULL;
+	return;
+}
+
+static struct fasta_input *open_fasta_file(const char *path)
+{
+	struct fasta_input *input;
+	gzFile gz;
+
+	gz = gzopen(path, "rb");
+	if (gz == NULL)
+		error("cannot open %s: %s", path, strerror(errno));
+	gzbuffer(gz, 128 * 1024);
+	input = (struct fasta_input *) R_alloc(1, sizeof(struct fasta_input));
+	input->path = path;
+	input->gz = gz;
+	input->buf = R_alloc(FASTA_BUF_SIZE, sizeof(char));
+	input->pos = input->end = 0;
+	input->header = R_alloc(FASTA_BUF_SIZE, sizeof(char));
+	input->line_no = 0;
+	input->at_bol = 1;
+	return input;
+}
+
+/* Refills input->buf if all its bytes were read. Returns 0 at the end of
+   the file. gzread() returns the data it was able to decompress from a
+   truncated gzip file without complaining so we also need to check
+   gzerror() once we reach the end of the file. */
+static int fill_fasta_buf(struct fasta_input *input)
+{
+	const char *msg;
+	char msg_buf[1024];
+	int n, errnum;
+
+	if (input->pos < input->end)
+		return 1;
+	n = gzread(input->gz, input->buf, FASTA_BUF_SIZE);
+	if (n > 0) {
+		input->pos = 0;
+		input->end = n;
+		return 1;
+	}
+	msg = gzerror(input->gz, &errnum);
+	if (n == 0 && errnum == Z_OK)
+		return 0;
+	/* 'msg' belongs to input->gz which gets closed by
+	   close_fasta_file(). It already contains the path to the file. */
+	snprintf(msg_buf, sizeof(msg_buf), "%s", msg);
+	close_fasta_file(input);
+	error("%s", msg_buf);
+	return 0;
+}
+
+/* Returns the next piece of the file in '*piece' and '*size' (without the
+   end-of-line characters for a header line), and what kind of piece it
+   is. Only the first FASTA_BUF_SIZE bytes of a header line are kept,
+   which is more than enough for the sequence name (255 chars max). */
+static int next_fasta_piece(struct fasta_input *input,
+			    char **piece, int *size)
+{
+	char *nl;
+	int n, header_size;
+
+	if (!fill_fasta_buf(input))
+		return FASTA_EOF;
+	if (input->at_bol) {
+		input->line_no++;
+		input->at_bol = 0;
+		if (input->buf[input->pos] == '>') {
+			header_size = 0;
+			do {
+				n = input->end - input->pos;
+				nl = memchr(input->buf + input->pos, '\n', n);
+				if (nl != NULL)
+					n = nl - (input->buf + input->pos);
+				if (n > FASTA_BUF_SIZE - header_size)
+					n = FASTA_BUF_SIZE - header_size;
+				memcpy(input->header + header_size,
+				       input->buf + input->pos, n);
+				header_size += n;
+				if (nl != NULL) {
+					input->pos = nl - input->buf + 1;
+					input->at_bol = 1;
+					break;
+				}
+				input->pos = input->end;
+			} while (fill_fasta_buf(input));
+			while (header_size > 0 &&
+			       input->header[header_size - 1] == '\r')
+				header_size--;
+			*piece = input->header;
+			*size = header_size;
+			return FASTA_HEADER;
+		}
+	}
+	n = input->end - input->pos;
+	nl = memchr(input->buf + input->pos, '\n', n);
+	if (nl != NULL) {
+		n = nl - (input->buf + input->pos);
+		input->at_bol = 1;
+	}
+	*piece = input->buf + input->pos;
+	*size = n;
+	input->pos += n + (nl != NULL);
+	return FASTA_SEQ;
+}
+
+/* Removes the whitespace from piece of sequence line 'line', in place, and
+   returns its new size, or -1 if it contains a character that is neither
+   a letter nor whitespace. Both passes clean the sequence lines with this
+   so they agree on the length of the sequences. */
+static int clean_sequence_line(char *line, int size)
+{
+	int i, n;
+	unsigned char c;
+
+	for (i = n = 0; i < size; i++) {
+		c = (unsigned char) line[i];
+		if (isalpha(c))
+			line[n++] = c;
+		else if (!isspace(c))
+			return -1;
+	}
+	return n;
+}
+
+/* Returns a copy (allocated with R_alloc()) of the sequence name found in
+   a header line i.e. of the first word after the '>', or NULL if the
+   header has no name. */
+static char *header_to_seqname(const char *line, int size)
+{
+	const char *name, *end;
+	char *ans;
+
+	end = line + size;
+	for (name = line + 1;
+	     name < end && isspace((unsigned char) *name);
+	     name++) {}
+	for (end = name;
+	     end < line + size && !isspace((unsigned char) *end);
+	     end++) {}
+	if (end == name)
+		return NULL;
+	ans = R_alloc(end - name + 1, sizeof(char));
+	memcpy(ans, name, end - name);
+	ans[end - name] = '\0';
+	return ans;
+}
+
+
+/****************************************************************************
+ * C_fasta_to_twobit()
+ */
+
+/* The records of the FASTA file, as found by scan_fasta_file(). */
+struct fasta_records {
+	int nrecord;
+	int *sizes;      /* sequence length of each record */
+	int *keep;       /* 1 if the record must be written, 0 otherwise */
+	int nkeep;
+	char **names;    /* names of the records to write */
+};
+
+static void grow_fasta_records(struct fasta_records *records, int *alloc)
+{
+	int *new_sizes, *new_keep;
+	char **new_names;
+	int new_alloc;
+
+	new_alloc = *alloc == 0 ? 1024 : 2 * *alloc;
+	new_sizes = (int *) R_alloc(new_alloc, sizeof(int));
+	new_keep = (int *) R_alloc(new_alloc, sizeof(int));
+	new_names = (char **) R_alloc(new_alloc, sizeof(char *));
+	if (*alloc != 0) {
+		memcpy(new_sizes, records->sizes, *alloc * sizeof(int));
+		memcpy(new_keep, records->keep, *alloc * sizeof(int));
+		memcpy(new_names, records->names, *alloc * sizeof(char *));
+	}
+	records->sizes = new_sizes;
+	records->keep = new_keep;
+	records->names = new_names;
+	*alloc = new_alloc;
+	return;
+}
+
+/* Applies the same rules as select_sequences_to_write() in
+   twobit_roundtrip.c: empty sequences are skipped with a warning,
+   duplicate names are an error unless 'skip_dups' is set in which case
+   only the first sequence with a given name is kept. Returns -1 if error,
+   1 if the record must be skipped, 0 otherwise. */
+static int check_fasta_record(const char *seqname, int size,
+			      boolean skip_dups, struct hash *uniqHash,
+			      char *msg_buf, int msg_buf_size)
+{
+	if (size == 0) {
+		snprintf(msg_buf, msg_buf_size,
+			 "sequence %s has length 0", seqname);
+		return 1;  /* skip sequence with warning */
+	}
+	if (hashLookup(uniqHash, seqname)) {
+		snprintf(msg_buf, msg_buf_size,
+			 "duplicate sequence name %s", seqname);
+		if (skip_dups)
+			return 1;  /* skip sequence with warning */
+		return -1;  /* error */
+	}
+	return 0;
+}
+
+/* First pass: finds the names and lengths of the sequences without
+   keeping the sequences themselves in memory. This is needed because the
+   index of the .2bit file comes before the sequence data. */
+static void scan_fasta_file(const char *path, boolean skip_dups,
+			    struct fasta_records *records)
+{
+	struct fasta_input *input;
+	struct hash *uniqHash;
+	char *piece, *seqname = NULL;
+	int size, alloc = 0, kind, ret;
+	long long seqsize = 0;
+	/* max seqname length is 255 for 2bit format */
+	char msg_buf[300];
+
+	memset(records, 0, sizeof(struct fasta_records));
+	uniqHash = newHash(18);
+	input = open_fasta_file(path);
+	do {
+		kind = next_fasta_piece(input, &piece, &size);
+		if (kind == FASTA_SEQ) {
+			size = clean_sequence_line(piece, size);
+			if (size == 0)
+				continue;
+			if (seqname == NULL) {
+				freeHash(&uniqHash);
+				close_fasta_file(input);
+				error("%s: sequence data found before "
+				      "the first FASTA header", path);
+			}
+			if (size < 0) {
+				freeHash(&uniqHash);
+				close_fasta_file(input);
+				error("%s: invalid character in sequence %s "
+				      "at line %d", path, seqname,
+				      input->line_no);
+			}
+			seqsize += size;
+			continue;
+		}
+		/* End of the current record. */
+		if (seqname != NULL) {
+			if (seqsize > INT_MAX) {
+				freeHash(&uniqHash);
+				close_fasta_file(input);
+				error("%s: sequence %s is too long (more than "
+				      "%d bases)", path, seqname, INT_MAX);
+			}
+			ret = check_fasta_record(seqname, seqsize, skip_dups,
+						 uniqHash, msg_buf,
+						 sizeof(msg_buf));
+			if (ret < 0) {
+				freeHash(&uniqHash);
+				close_fasta_file(input);
+				error("%s", msg_buf);
+			}
+			records->sizes[records->nrecord] = seqsize;
+			records->keep[records->nrecord] = ret == 0;
+			records->nrecord++;
+			if (ret > 0) {
+				warning("%s ==> skipping it", msg_buf);
+			} else {
+				hashAdd(uniqHash, seqname, NULL);
+				records->names[records->nkeep++] = seqname;
+			}
+			seqname = NULL;
+		}
+		if (kind == FASTA_EOF)
+			break;
+		/* Start of a new record. */
+		if (records->nrecord == alloc)
+			grow_fasta_records(records, &alloc);
+		seqname = header_to_seqname(piece, size);
+		if (seqname == NULL) {
+			freeHash(&uniqHash);
+			close_fasta_file(input);
+			error("%s: missing sequence name in FASTA header "
+			      "at line %d", path, input->line_no);
+		}
+		seqsize = 0;
+	} while (kind != FASTA_EOF);
+	close_fasta_file(input);
+	freeHash(&uniqHash);
+	return;
+}
+
+/* Second pass: packs the sequences to write one at a time, as they are
+   read, and passes them to 'writer'. Returns the first negative value
+   returned by twoBitWriterAdd() or 0 on success. */
+static int pack_fasta_file(const char *path,
+			   const struct fasta_records *records,
+			   struct twoBitWriter *writer, const char **msg)
+{
+	struct fasta_input *input;
+	struct twoBitPacker *packer = NULL;
+	struct twoBit *twoBit;
+	char *piece;
+	int size, i = -1, k = 0, ret = 0, kind;
+
+	input = open_fasta_file(path);
+	do {
+		kind = next_fasta_piece(input, &piece, &size);
+		if (kind == FASTA_SEQ) {
+			/* The piece was checked by scan_fasta_file(). */
+			size = clean_sequence_line(piece, size);
+			if (packer != NULL && size > 0)
+				twoBitPackerAdd(packer, piece, size);
+			continue;
+		}
+		/* End of the current record. */
+		if (packer != NULL) {
+			twoBit = twoBitPackerFinish(&packer);
+			ret = twoBitWriterAdd(writer, twoBit, msg);
+			/* twoBitFree() does not free the name. */
+			freez(&twoBit->name);
+			twoBitFree(&twoBit);
+			if (ret < 0)
+				break;
+		}
+		/* Start of a new record. */
+		if (kind == FASTA_HEADER && records->keep[++i])
+			packer = twoBitPackerNew(records->names[k++],
+						 records->sizes[i], TRUE);
+	} while (kind != FASTA_EOF);
+	close_fasta_file(input);
+	return ret;
+}
+
+/* --- .Call ENTRY POINT --- */
+SEXP C_fasta_to_twobit(SEXP filepath, SEXP destpath, SEXP use_long,
+		       SEXP skip_dups)
+{
+	const char *path, *dest, *msg;
+	struct fasta_records records;
+	struct twoBitWriter *writer;
+	FILE *f;
+	int ret;
+
+	path = _filepath2str(filepath);
+	dest = _filepath2str(destpath);
+
+	scan_fasta_file(path, LOGICAL(skip_dups)[0], &records);
+
+	/* Open destination file. */
+	f = fopen(dest, "wb");
+	if (f == NULL)
+		error("cannot open %s to write: %s", dest, strerror(errno));
+
+	/* Write the header and the index. The offsets in the index get
+	   filled in once all the sequences have been written. */
+	writer = twoBitWriterOpen(f, records.names, records.nkeep,
+				  LOGICAL(use_long)[0], &msg);
+	if (writer == NULL)
+		_abort_twobit_write(f, dest, -1, LOGICAL(use_long)[0], msg,
+				    "fasta_to_twobit");
+
+	ret = pack_fasta_file(path, &records, writer, &msg);
+	if (ret < 0) {
+		twoBitWriterFree(&writer);
+		_abort_twobit_write(f, dest, ret, LOGICAL(use_long)[0], msg,
+				    "fasta_to_twobit");
+	}
+
+	ret = twoBitWriterClose(&writer, &msg);
+	if (ret < 0)
+		_abort_twobit_write(f, dest, ret, LOGICAL(use_long)[0], msg,
+				    "fasta_to_twobit");
+
+	/* Close file. */
+	if (fclose(f) != 0)
+		error("error writing %s: %s", dest, strerror(errno));
+	return R_NilValue;
+}
@@ -0,0 +1,9 @@
+#ifndef _FASTA_TO_TWOBIT_H_
+#define _FASTA_TO_TWOBIT_H_
+
+#include <Rdefines.h>
+
+SEXP C_fasta_to_twobit(SEXP filepath, SEXP destpath, SEXP use_long,
+		       SEXP skip_dups);
+
+#endif  /* _FASTA_TO_TWOBIT_H_ */
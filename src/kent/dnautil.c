@@ -15,6 +15,14 @@
 #include "common.h"
 #include "dnautil.h"
 
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define DNA_SIMD_X86
+#include <immintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#define DNA_SIMD_NEON
+#include <arm_neon.h>
+#endif
+
 
 struct codonTable
 /* The dread codon table. */
@@ -808,24 +816,292 @@ for (i=0; i<tileCount; ++i)
     }
 }
 
-void unpackDna4(UBYTE *tiles, int byteCount, DNA *out)
-/* Unpack DNA. Expands to 4x byteCount in output. */
+/* Unpacking kernels for 4 bases per byte, most significant bits first.
+ * The SIMD kernels spread each packed byte over 4 output lanes, keep the
+ * high nibble in 2 of them and the low nibble in the other 2, then look the
+ * letters up in 2 nibble tables: one for the first base of a nibble, one
+ * for the second.  For the reverse complement the input bytes are taken
+ * from the end and reversed with a shuffle, the lanes of each byte are
+ * swapped around and the tables hold the complemented letters.  Kernels
+ * only handle whole blocks of 16 bytes and return how many bytes they
+ * unpacked, unpackDna4Words() or unpackDna4RcWords() does the rest. */
+
+struct unpackTables
+/* What an unpacking kernel needs to output one case on one strand. */
+    {
+    DNA first[16];		/* Letter of first base of each nibble value. */
+    DNA second[16];		/* Letter of second base of each nibble value. */
+    UBYTE highLanes[16];	/* 0xff for output lanes that use the high nibble. */
+    UBYTE firstLanes[16];	/* 0xff for output lanes that use the first base. */
+    boolean reverse;		/* Take the input bytes from the end. */
+    };
+
+/* Tables for lower case (valToNt) and upper case (valToNtMasked), forward
+ * and reverse complemented. */
+static struct unpackTables lowerTables, upperTables, lowerRcTables, upperRcTables;
+
+static void makeUnpackTables(const DNA *table, boolean isRc, struct unpackTables *ut)
+/* Fill in unpacking tables from table, which maps X_BASE_VAL to a letter.
+ * Complementing a base value flips its 2 bit. */
+{
+int comp = (isRc ? 2 : 0);
+int i;
+for (i=0; i<16; ++i)
+    {
+    int lane = (i & 3);
+    ut->first[i] = table[(i >> 2) ^ comp];
+    ut->second[i] = table[(i & 3) ^ comp];
+    if (isRc)
+	{
+	ut->highLanes[i] = (lane >= 2 ? 0xff : 0);
+	ut->firstLanes[i] = (lane & 1 ? 0xff : 0);
+	}
+    else
+	{
+	ut->highLanes[i] = (lane < 2 ? 0xff : 0);
+	ut->firstLanes[i] = (lane & 1 ? 0 : 0xff);
+	}
+    }
+ut->reverse = isRc;
+}
+
+typedef int (*UnpackDna4Kernel)(const UBYTE *tiles, int byteCount, DNA *out,
+	const struct unpackTables *ut);
+
+/* Lower case letters of the 4 bases of each packed byte. */
+static DNA packedByteToNt[256][4];
+
+static void initPackedByteToNt(void)
+/* Fill in packedByteToNt from valToNt. */
 {
 int i, j;
-UBYTE tile;
+for (i=0; i<256; ++i)
+    for (j=0; j<4; ++j)
+	packedByteToNt[i][j] = valToNt[(i >> (6-j-j)) & 3];
+}
+
+static void unpackDna4Words(const UBYTE *tiles, int byteCount, DNA *out, bits32 caseMask)
+/* Unpack 4 bases at a time with packedByteToNt, and-ing the letters with
+ * caseMask (0xdfdfdfdf upper cases them). */
+{
+int i;
+bits32 word;
 
 for (i=0; i<byteCount; ++i)
     {
-    tile = tiles[i];
-    for (j=3; j>=0; --j)
-        {
-        out[j] = valToNt[tile & 0x3];
-        tile >>= 2;
-        }
-    out += 4;
+    memcpy(&word, packedByteToNt[tiles[i]], 4);
+    word &= caseMask;
+    memcpy(out + 4*i, &word, 4);
+    }
+}
+
+static void unpackDna4RcWords(const UBYTE *tiles, int byteCount, DNA *out, bits32 caseMask)
+/* Like unpackDna4Words() but output the reverse complement, the last byte
+ * first. */
+{
+int i;
+bits32 word;
+
+for (i=0; i<byteCount; ++i)
+    {
+    /* Complement the 4 bases then reverse their order. */
+    UBYTE b = tiles[byteCount-1-i] ^ 0xaa;
+    b = ((b & 0x03) << 6) | ((b & 0x0c) << 2) | ((b & 0x30) >> 2) | ((b & 0xc0) >> 6);
+    memcpy(&word, packedByteToNt[b], 4);
+    word &= caseMask;
+    memcpy(out + 4*i, &word, 4);
     }
 }
 
+static int unpackDna4None(const UBYTE *tiles, int byteCount, DNA *out,
+	const struct unpackTables *ut)
+/* Kernel when there are no SIMD instructions: leave it all to
+ * unpackDna4Words(). */
+{
+return 0;
+}
+
+#if defined(DNA_SIMD_X86) || defined(DNA_SIMD_NEON)
+/* Which byte of the 4 input bytes each output lane comes from, and the
+ * shuffle that reverses 16 bytes. */
+static const UBYTE spreadLanes[16] = {0,0,0,0, 1,1,1,1, 2,2,2,2, 3,3,3,3};
+static const UBYTE reverseLanes[16] = {15,14,13,12, 11,10,9,8, 7,6,5,4, 3,2,1,0};
+#endif
+
+#if defined(DNA_SIMD_X86)
+__attribute__((target("ssse3")))
+static int unpackDna4Ssse3(const UBYTE *tiles, int byteCount, DNA *out,
+	const struct unpackTables *ut)
+/* Unpack 16 bytes (64 bases) per loop using SSSE3 byte shuffles. */
+{
+int i, j;
+__m128i firstTab = _mm_loadu_si128((const __m128i *)ut->first);
+__m128i secondTab = _mm_loadu_si128((const __m128i *)ut->second);
+__m128i spread = _mm_loadu_si128((const __m128i *)spreadLanes);
+__m128i reverse = _mm_loadu_si128((const __m128i *)reverseLanes);
+__m128i highSel = _mm_loadu_si128((const __m128i *)ut->highLanes);
+__m128i firstSel = _mm_loadu_si128((const __m128i *)ut->firstLanes);
+__m128i nibMask = _mm_set1_epi8(0x0f);
+__m128i four = _mm_set1_epi8(4);
+
+for (i=0; i+16<=byteCount; i += 16)
+    {
+    __m128i in;
+    if (ut->reverse)
+	in = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(tiles + byteCount-16-i)),
+			      reverse);
+    else
+	in = _mm_loadu_si128((const __m128i *)(tiles + i));
+    __m128i ix = spread;
+    for (j=0; j<4; ++j)
+	{
+	__m128i rep = _mm_shuffle_epi8(in, ix);
+	__m128i high = _mm_and_si128(_mm_srli_epi16(rep, 4), nibMask);
+	__m128i low = _mm_and_si128(rep, nibMask);
+	__m128i nib = _mm_or_si128(_mm_and_si128(highSel, high),
+				   _mm_andnot_si128(highSel, low));
+	__m128i first = _mm_shuffle_epi8(firstTab, nib);
+	__m128i second = _mm_shuffle_epi8(secondTab, nib);
+	__m128i res = _mm_or_si128(_mm_and_si128(firstSel, first),
+				   _mm_andnot_si128(firstSel, second));
+	_mm_storeu_si128((__m128i *)(out + 4*i + 16*j), res);
+	ix = _mm_add_epi8(ix, four);
+	}
+    }
+return i;
+}
+
+__attribute__((target("avx2")))
+static int unpackDna4Avx2(const UBYTE *tiles, int byteCount, DNA *out,
+	const struct unpackTables *ut)
+/* Unpack 16 bytes (64 bases) per loop using AVX2 byte shuffles, 32 bases
+ * at a time. */
+{
+int i, j;
+__m256i firstTab = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)ut->first));
+__m256i secondTab = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)ut->second));
+__m128i spread128 = _mm_loadu_si128((const __m128i *)spreadLanes);
+/* Second 128-bit lane handles the next 4 input bytes. */
+__m256i spread = _mm256_inserti128_si256(_mm256_castsi128_si256(spread128),
+		    _mm_add_epi8(spread128, _mm_set1_epi8(4)), 1);
+__m128i reverse = _mm_loadu_si128((const __m128i *)reverseLanes);
+__m256i highSel = _mm256_broadcastsi128_si256(
+		    _mm_loadu_si128((const __m128i *)ut->highLanes));
+__m256i firstSel = _mm256_broadcastsi128_si256(
+		    _mm_loadu_si128((const __m128i *)ut->firstLanes));
+__m256i nibMask = _mm256_set1_epi8(0x0f);
+__m256i eight = _mm256_set1_epi8(8);
+
+for (i=0; i+16<=byteCount; i += 16)
+    {
+    __m128i in128;
+    if (ut->reverse)
+	in128 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(tiles + byteCount-16-i)),
+				 reverse);
+    else
+	in128 = _mm_loadu_si128((const __m128i *)(tiles + i));
+    __m256i in = _mm256_broadcastsi128_si256(in128);
+    __m256i ix = spread;
+    for (j=0; j<2; ++j)
+	{
+	__m256i rep = _mm256_shuffle_epi8(in, ix);
+	__m256i high = _mm256_and_si256(_mm256_srli_epi16(rep, 4), nibMask);
+	__m256i low = _mm256_and_si256(rep, nibMask);
+	__m256i nib = _mm256_blendv_epi8(low, high, highSel);
+	__m256i first = _mm256_shuffle_epi8(firstTab, nib);
+	__m256i second = _mm256_shuffle_epi8(secondTab, nib);
+	__m256i res = _mm256_blendv_epi8(second, first, firstSel);
+	_mm256_storeu_si256((__m256i *)(out + 4*i + 32*j), res);
+	ix = _mm256_add_epi8(ix, eight);
+	}
+    }
+return i;
+}
+#endif /* DNA_SIMD_X86 */
+
+#if defined(DNA_SIMD_NEON)
+static int unpackDna4Neon(const UBYTE *tiles, int byteCount, DNA *out,
+	const struct unpackTables *ut)
+/* Unpack 16 bytes (64 bases) per loop using NEON table lookups. */
+{
+int i, j;
+uint8x16_t firstTab = vld1q_u8((const uint8_t *)ut->first);
+uint8x16_t secondTab = vld1q_u8((const uint8_t *)ut->second);
+uint8x16_t spread = vld1q_u8(spreadLanes);
+uint8x16_t reverse = vld1q_u8(reverseLanes);
+uint8x16_t highSel = vld1q_u8(ut->highLanes);
+uint8x16_t firstSel = vld1q_u8(ut->firstLanes);
+uint8x16_t nibMask = vdupq_n_u8(0x0f);
+uint8x16_t four = vdupq_n_u8(4);
+
+for (i=0; i+16<=byteCount; i += 16)
+    {
+    uint8x16_t in;
+    if (ut->reverse)
+	in = vqtbl1q_u8(vld1q_u8(tiles + byteCount-16-i), reverse);
+    else
+	in = vld1q_u8(tiles + i);
+    uint8x16_t ix = spread;
+    for (j=0; j<4; ++j)
+	{
+	uint8x16_t rep = vqtbl1q_u8(in, ix);
+	uint8x16_t nib = vbslq_u8(highSel, vshrq_n_u8(rep, 4), vandq_u8(rep, nibMask));
+	uint8x16_t res = vbslq_u8(firstSel, vqtbl1q_u8(firstTab, nib),
+				  vqtbl1q_u8(secondTab, nib));
+	vst1q_u8((uint8_t *)(out + 4*i + 16*j), res);
+	ix = vaddq_u8(ix, four);
+	}
+    }
+return i;
+}
+#endif /* DNA_SIMD_NEON */
+
+static UnpackDna4Kernel unpackDna4Kernel = unpackDna4None;
+
+static void initUnpackDna4Kernel(void)
+/* Pick the fastest unpacking kernel the CPU supports. */
+{
+initPackedByteToNt();
+makeUnpackTables(valToNt, FALSE, &lowerTables);
+makeUnpackTables(valToNtMasked, FALSE, &upperTables);
+makeUnpackTables(valToNt, TRUE, &lowerRcTables);
+makeUnpackTables(valToNtMasked, TRUE, &upperRcTables);
+#if defined(DNA_SIMD_X86)
+__builtin_cpu_init();
+if (__builtin_cpu_supports("avx2"))
+    unpackDna4Kernel = unpackDna4Avx2;
+else if (__builtin_cpu_supports("ssse3"))
+    unpackDna4Kernel = unpackDna4Ssse3;
+#elif defined(DNA_SIMD_NEON)
+unpackDna4Kernel = unpackDna4Neon;
+#endif
+}
+
+void unpackDna4(const UBYTE *tiles, int byteCount, DNA *out)
+/* Unpack DNA. Expands to 4x byteCount in output.  Uses SIMD instructions
+ * where the CPU has them, which needs dnaUtilOpen() to have been called. */
+{
+int done = (byteCount >= 16 ? (*unpackDna4Kernel)(tiles, byteCount, out, &lowerTables) : 0);
+unpackDna4Words(tiles + done, byteCount - done, out + 4*done, 0xffffffff);
+}
+
+void unpackDna4Upper(const UBYTE *tiles, int byteCount, DNA *out)
+/* Like unpackDna4() but unpack to upper case. */
+{
+int done = (byteCount >= 16 ? (*unpackDna4Kernel)(tiles, byteCount, out, &upperTables) : 0);
+unpackDna4Words(tiles + done, byteCount - done, out + 4*done, 0xdfdfdfdf);
+}
+
+void unpackDna4RevComp(const UBYTE *tiles, int byteCount, DNA *out, boolean upper)
+/* Unpack the reverse complement of the 4*byteCount bases in tiles into out,
+ * in upper case if upper is set and in lower case otherwise. */
+{
+const struct unpackTables *ut = (upper ? &upperRcTables : &lowerRcTables);
+int done = (byteCount >= 16 ? (*unpackDna4Kernel)(tiles, byteCount, out, ut) : 0);
+/* The kernel did the last done bytes of tiles. */
+unpackDna4RcWords(tiles, byteCount - done, out + 4*done, (upper ? 0xdfdfdfdf : 0xffffffff));
+}
+
 
 
 
@@ -932,6 +1208,36 @@ while (lettersLeft > 0)
     }
 }
 
+size_t seqWithBreaksSize(size_t letterCount, int maxPerLine)
+/* Return number of bytes formatSeqWithBreaks() will write for letterCount
+ * letters. */
+{
+return letterCount + (letterCount + maxPerLine - 1) / maxPerLine;
+}
+
+char *formatSeqWithBreaks(char *out, const char *letters, size_t letterCount,
+	int maxPerLine)
+/* Copy letters to out with newlines every maxLine, like writeSeqWithBreaks()
+ * does to a file.  Out must have room for seqWithBreaksSize() bytes.  No
+ * zero is added at the end.  Returns position in out just past the last
+ * newline. */
+{
+size_t lettersLeft = letterCount;
+size_t lineSize;
+while (lettersLeft > 0)
+    {
+    lineSize = lettersLeft;
+    if (lineSize > (size_t)maxPerLine)
+        lineSize = maxPerLine;
+    memcpy(out, letters, lineSize);
+    out += lineSize;
+    *out++ = '\n';
+    letters += lineSize;
+    lettersLeft -= lineSize;
+    }
+return out;
+}
+
 boolean isDna(char *poly, int size)
 /* Return TRUE if letters in poly are at least 90% ACGTNU- */
 {
@@ -1046,6 +1352,7 @@ if (!opened)
     initNtChars();
     initNtMixedCaseChars();
     initNtCompTable();
+    initUnpackDna4Kernel();
     opened = TRUE;
     }
 }
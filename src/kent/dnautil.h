@@ -206,8 +206,16 @@ UBYTE packDna4(const DNA *in);
 void unpackDna(bits32 *tiles, int tileCount, DNA *out);
 /* Unpack DNA. Expands to 16x tileCount in output. */
 
-void unpackDna4(UBYTE *tiles, int byteCount, DNA *out);
-/* Unpack DNA. Expands to 4x byteCount in output. */
+void unpackDna4(const UBYTE *tiles, int byteCount, DNA *out);
+/* Unpack DNA. Expands to 4x byteCount in output.  Uses SIMD instructions
+ * where the CPU has them, which needs dnaUtilOpen() to have been called. */
+
+void unpackDna4Upper(const UBYTE *tiles, int byteCount, DNA *out);
+/* Like unpackDna4() but unpack to upper case. */
+
+void unpackDna4RevComp(const UBYTE *tiles, int byteCount, DNA *out, boolean upper);
+/* Unpack the reverse complement of the 4*byteCount bases in tiles into out,
+ * in upper case if upper is set and in lower case otherwise. */
 
 void unalignedUnpackDna(bits32 *tiles, int start, int size, DNA *unpacked);
 /* Unpack into out, even though not starting/stopping on tile 
@@ -244,6 +252,17 @@ int  dnaOrAaScoreMatch(char *a, char *b, int size, int matchScore, int mismatchS
 void writeSeqWithBreaks(FILE *f, char *letters, int letterCount, int maxPerLine);
 /* Write out letters with newlines every maxLine. */
 
+size_t seqWithBreaksSize(size_t letterCount, int maxPerLine);
+/* Return number of bytes formatSeqWithBreaks() will write for letterCount
+ * letters. */
+
+char *formatSeqWithBreaks(char *out, const char *letters, size_t letterCount,
+	int maxPerLine);
+/* Copy letters to out with newlines every maxLine, like writeSeqWithBreaks()
+ * does to a file.  Out must have room for seqWithBreaksSize() bytes.  No
+ * zero is added at the end.  Returns position in out just past the last
+ * newline. */
+
 boolean isDna(char *poly, int size);
 /* Return TRUE if letters in poly are at least 90% ACGTNU- */
 
@@ -311,7 +311,9 @@ while (!gotLf)
 	memmove(buf, buf+oldEnd, sizeLeft);
 	}
     lf->bufOffsetInFile += oldEnd;
-    if (lf->fd >= 0)
+    if (lf->readCallBack != NULL)
+	readSize = lf->readCallBack(lf, buf+sizeLeft, readSize);
+    else if (lf->fd >= 0)
 	readSize = lineFileLongNetRead(lf->fd, buf+sizeLeft, readSize);
     else if (lf->tabix != NULL && readSize > 0)
 	{
@@ -401,6 +403,8 @@ if ((lf = *pLf) != NULL)
 	close(lf->fd);
 	freeMem(lf->buf);
 	}
+    else if (lf->readCallBack != NULL)
+	freeMem(lf->buf);
     else if (lf->udcFile != NULL)
 	errAbort("lf->udcFile != NULL not supported");
 
@@ -68,6 +68,8 @@ struct lineFile
     void(*checkSupport)(struct lineFile *lf, char *where); // check if operation supported 
     boolean(*nextCallBack)(struct lineFile *lf, char **retStart, int *retSize); // next line callback
     void(*closeCallBack)(struct lineFile *lf);             // close callback
+    int(*readCallBack)(struct lineFile *lf, char *buf, int size); // read callback, used
+                                // instead of fd to fill buf (e.g. to read compressed data)
     };
 
 struct lineFile *lineFileMayOpen(const char *fileName, bool zTerm);
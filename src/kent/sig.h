@@ -62,6 +62,13 @@
 #define twoBitSwapSig 0x4327411A
 /* Signature of byte-swapped two-bit file. */
 
+#define twoBitSummarySig 0x1A5B2743
+/* Signature of 2bit summary file (per sequence sizes and block totals of
+ * a 2bit file).  Not in kent-core. */
+
+#define twoBitSummarySwapSig 0x43275B1A
+/* Signature of byte-swapped 2bit summary file. */
+
 #define chromGraphSig 0x4528421C
 /* Signature of chromGraph binary data file */
 
@@ -2,6 +2,7 @@
  * See kent/LICENSE or http://genome.ucsc.edu/license/ for licensing information. */
 
 #include "common.h"
+#include "errAbort.h"
 #include "hash.h"
 #include "dnaseq.h"
 #include "sig.h"
@@ -9,6 +10,15 @@
 #include "obscure.h"
 #include "twoBit.h"
 #include <limits.h>
+#include <time.h>
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
 
 /* following are the wrap functions for the UDC and stdio functoins
  * that read twoBit files.   All of these are to get around the C compiler
@@ -34,6 +44,15 @@ static void mustReadWrap(void *file, void *buf, size_t size)
 mustRead((FILE *)file, buf, size);
 }
 
+static size_t readWrap(void *file, void *buf, size_t size)
+/* Read up to size bytes, fewer only at end of file. */
+{
+size_t actualSize = fread(buf, 1, size, (FILE *)file);
+if (actualSize < size && ferror((FILE *)file))
+    errnoAbort("Error reading %lld bytes", (long long)size);
+return actualSize;
+}
+
 static void fileCloseWrap(void *pFile)
 {
 carefulClose((FILE **)pFile);
@@ -54,6 +73,420 @@ static boolean fastReadStringWrap(void *f, char buf[256])
 return fastReadString((FILE *)f, buf);
 }
 
+#ifndef _WIN32
+static boolean readAtWrap(void *file, bits64 offset, void *buf, size_t size)
+/* Positional read that leaves the file position alone, so it is safe to use
+ * from several threads at once.  Returns FALSE on error or end of file. */
+{
+int fd = fileno((FILE *)file);
+char *cbuf = buf;
+while (size > 0)
+    {
+    ssize_t actualSize = pread(fd, cbuf, min(0x7FFF000, size), offset);
+    if (actualSize < 0 && errno == EINTR)
+	continue;
+    if (actualSize <= 0)
+	return FALSE;
+    cbuf += actualSize;
+    offset += actualSize;
+    size -= actualSize;
+    }
+return TRUE;
+}
+#endif
+
+struct twoBitMemFile
+/* A .2bit file image held in memory, with a read position that emulates
+ * stdio so that it can sit behind the same function pointers. */
+    {
+    UBYTE *data;		/* Start of file image. */
+    bits64 size;		/* Size of file image in bytes. */
+    bits64 pos;			/* Current read position. */
+    boolean isMapped;		/* TRUE if data must be munmap()'ed on close. */
+    boolean isBorrowed;		/* TRUE if data belongs to the caller and is left alone on close. */
+    char *fileName;		/* Name of file, for error reporting. */
+    };
+
+static void memSeekCurWrap(void *file, bits64 offset)
+{
+((struct twoBitMemFile *)file)->pos += offset;
+}
+
+static void memSeekWrap(void *file, bits64 offset)
+{
+((struct twoBitMemFile *)file)->pos = offset;
+}
+
+static bits64 memTellWrap(void *file)
+{
+return ((struct twoBitMemFile *)file)->pos;
+}
+
+static UBYTE *memMapAtWrap(void *file, bits64 offset, size_t size)
+/* Return pointer to size bytes at offset in the image, or NULL if that
+ * range is not entirely inside the image. */
+{
+struct twoBitMemFile *mf = file;
+if (offset > mf->size || size > mf->size - offset)
+    return NULL;
+return mf->data + offset;
+}
+
+static boolean memReadAtWrap(void *file, bits64 offset, void *buf, size_t size)
+{
+UBYTE *pt = memMapAtWrap(file, offset, size);
+if (pt == NULL)
+    return FALSE;
+memcpy(buf, pt, size);
+return TRUE;
+}
+
+static void memMustReadWrap(void *file, void *buf, size_t size)
+{
+struct twoBitMemFile *mf = file;
+UBYTE *pt = memMapAtWrap(mf, mf->pos, size);
+if (pt == NULL)
+    errAbort("End of file reading %lld bytes from %s", (long long)size, mf->fileName);
+memcpy(buf, pt, size);
+mf->pos += size;
+}
+
+static size_t memReadWrap(void *file, void *buf, size_t size)
+{
+struct twoBitMemFile *mf = file;
+if (mf->pos >= mf->size)
+    return 0;
+if (size > mf->size - mf->pos)
+    size = mf->size - mf->pos;
+memcpy(buf, mf->data + mf->pos, size);
+mf->pos += size;
+return size;
+}
+
+static void memCloseWrap(void *pFile)
+{
+struct twoBitMemFile **pMf = pFile, *mf = *pMf;
+if (mf != NULL)
+    {
+#ifndef _WIN32
+    if (mf->isMapped && munmap(mf->data, mf->size) < 0)
+	warn("munmap() failed on %s: %s", mf->fileName, strerror(errno));
+#endif
+    if (!mf->isMapped && !mf->isBorrowed)
+	freeMem(mf->data);
+    freeMem(mf->fileName);
+    freez(pMf);
+    }
+}
+
+static bits32 memReadBits32Wrap(void *f, boolean isSwapped)
+{
+bits32 val;
+memMustReadWrap(f, &val, sizeof(val));
+if (isSwapped)
+    val = byteSwap32(val);
+return val;
+}
+
+static bits64 memReadBits64Wrap(void *f, boolean isSwapped)
+{
+bits64 val;
+memMustReadWrap(f, &val, sizeof(val));
+if (isSwapped)
+    val = byteSwap64(val);
+return val;
+}
+
+static boolean memFastReadStringWrap(void *f, char buf[256])
+{
+struct twoBitMemFile *mf = f;
+int len;
+if (mf->pos >= mf->size)
+    return FALSE;
+len = mf->data[mf->pos++];
+memMustReadWrap(mf, buf, len);
+buf[len] = 0;
+return TRUE;
+}
+
+static struct twoBitMemFile *memFileMap(const char *fileName)
+/* Map file into memory.  Where mmap() is not available (Windows) the
+ * file is read in whole instead. */
+{
+struct twoBitMemFile *mf;
+struct stat st;
+FILE *f = mustOpen(fileName, "rb");
+
+if (fstat(fileno(f), &st) < 0)
+    errnoAbort("fstat() failed on %s", fileName);
+AllocVar(mf);
+mf->fileName = cloneString(fileName);
+mf->size = st.st_size;
+if (mf->size > 0)
+    {
+#ifdef _WIN32
+    mf->data = needLargeMem(mf->size);
+    mustRead(f, mf->data, mf->size);
+#else
+    void *pt = mmap(NULL, mf->size, PROT_READ, MAP_SHARED, fileno(f), 0);
+    if (pt == MAP_FAILED)
+	errnoAbort("mmap() failed on %s", fileName);
+    mf->data = pt;
+    mf->isMapped = TRUE;
+#endif
+    }
+carefulClose(&f);
+return mf;
+}
+
+static struct twoBitMemFile *memFileWrap(const char *name, const void *data, bits64 size)
+/* Wrap a file image that belongs to the caller.  It is only ever read. */
+{
+struct twoBitMemFile *mf;
+AllocVar(mf);
+mf->fileName = cloneString(name);
+mf->data = (UBYTE *)data;
+mf->size = size;
+mf->isBorrowed = TRUE;
+return mf;
+}
+
+static void setMemFileFuncs(struct twoBitFile *tbf)
+/* Install the function pointers for a twoBit held in memory. */
+{
+tbf->ourSeekCur = memSeekCurWrap;
+tbf->ourSeek = memSeekWrap;
+tbf->ourTell = memTellWrap;
+tbf->ourReadBits32 = memReadBits32Wrap;
+tbf->ourReadBits64 = memReadBits64Wrap;
+tbf->ourFastReadString = memFastReadStringWrap;
+tbf->ourClose = memCloseWrap;
+tbf->ourMustRead = memMustReadWrap;
+tbf->ourRead = memReadWrap;
+tbf->ourMapAt = memMapAtWrap;
+tbf->ourReadAt = memReadAtWrap;
+}
+
+#define posFileBufSize 4096
+/* Size of the read-ahead buffer of a twoBitPosFile. */
+
+struct twoBitPosFile
+/* An open .2bit file read through positional reads, pread() or those of
+ * a caller (see twoBitOpenCallbacks()), at a read position kept here rather
+ * than in an open file description, which a forked child process would
+ * share with its parent.  Small reads are served from a read-ahead buffer
+ * like with stdio. */
+    {
+    struct twoBitIOFuncs funcs;	/* Routines doing the reads. */
+    void *data;			/* Passed to funcs. */
+    bits64 size;		/* Size of file. */
+    bits64 pos;			/* Current read position. */
+    bits64 bufStart;		/* File offset of buf. */
+    size_t bufSize;		/* Number of bytes in buf. */
+    char *fileName;		/* Name of file, for error reporting. */
+    UBYTE buf[posFileBufSize];	/* Read-ahead buffer. */
+    };
+
+static size_t posFileRead(struct twoBitPosFile *pf, void *buf, size_t size, bits64 offset)
+/* Read up to size bytes at offset, fewer only at end of file. */
+{
+if (offset >= pf->size)
+    return 0;
+if (size > pf->size - offset)
+    size = pf->size - offset;
+if (!(*pf->funcs.readAt)(pf->data, offset, buf, size))
+    errAbort("Error reading %lld bytes from %s", (long long)size, pf->fileName);
+return size;
+}
+
+static void posSeekCurWrap(void *file, bits64 offset)
+{
+((struct twoBitPosFile *)file)->pos += offset;
+}
+
+static void posSeekWrap(void *file, bits64 offset)
+{
+((struct twoBitPosFile *)file)->pos = offset;
+}
+
+static bits64 posTellWrap(void *file)
+{
+return ((struct twoBitPosFile *)file)->pos;
+}
+
+static size_t posReadWrap(void *file, void *buf, size_t size)
+/* Read up to size bytes, fewer only at end of file. */
+{
+struct twoBitPosFile *pf = file;
+UBYTE *cbuf = buf;
+size_t actualSize = 0;
+while (size > 0)
+    {
+    size_t n;
+    if (pf->pos < pf->bufStart || pf->pos >= pf->bufStart + pf->bufSize)
+	{
+	if (size >= posFileBufSize)
+	    {
+	    /* Big reads bypass the buffer. */
+	    n = posFileRead(pf, cbuf, size, pf->pos);
+	    pf->pos += n;
+	    actualSize += n;
+	    break;
+	    }
+	pf->bufStart = pf->pos;
+	pf->bufSize = posFileRead(pf, pf->buf, posFileBufSize, pf->pos);
+	if (pf->bufSize == 0)
+	    break;
+	}
+    n = min(size, pf->bufStart + pf->bufSize - pf->pos);
+    memcpy(cbuf, pf->buf + (pf->pos - pf->bufStart), n);
+    cbuf += n;
+    pf->pos += n;
+    actualSize += n;
+    size -= n;
+    }
+return actualSize;
+}
+
+static void posMustReadWrap(void *file, void *buf, size_t size)
+{
+if (posReadWrap(file, buf, size) < size)
+    errAbort("End of file reading %lld bytes from %s", (long long)size,
+	((struct twoBitPosFile *)file)->fileName);
+}
+
+static bits32 posReadBits32Wrap(void *f, boolean isSwapped)
+{
+bits32 val;
+posMustReadWrap(f, &val, sizeof(val));
+if (isSwapped)
+    val = byteSwap32(val);
+return val;
+}
+
+static bits64 posReadBits64Wrap(void *f, boolean isSwapped)
+{
+bits64 val;
+posMustReadWrap(f, &val, sizeof(val));
+if (isSwapped)
+    val = byteSwap64(val);
+return val;
+}
+
+static boolean posFastReadStringWrap(void *f, char buf[256])
+{
+UBYTE len;
+if (posReadWrap(f, &len, 1) == 0)
+    return FALSE;
+posMustReadWrap(f, buf, len);
+buf[len] = 0;
+return TRUE;
+}
+
+static boolean posReadAtWrap(void *file, bits64 offset, void *buf, size_t size)
+/* Positional read that doesn't touch the read position or buffer. */
+{
+struct twoBitPosFile *pf = file;
+if (offset > pf->size || size > pf->size - offset)
+    return FALSE;
+return (*pf->funcs.readAt)(pf->data, offset, buf, size);
+}
+
+static boolean posReadAtvWrap(void *file, const struct twoBitIOVec *vecs, int count)
+/* Vectored read that doesn't touch the read position or buffer. */
+{
+struct twoBitPosFile *pf = file;
+int i;
+for (i = 0; i < count; ++i)
+    {
+    if (vecs[i].offset > pf->size || vecs[i].size > pf->size - vecs[i].offset)
+	return FALSE;
+    }
+if (pf->funcs.readv != NULL)
+    return (*pf->funcs.readv)(pf->data, vecs, count);
+for (i = 0; i < count; ++i)
+    {
+    if (!(*pf->funcs.readAt)(pf->data, vecs[i].offset, vecs[i].buf, vecs[i].size))
+	return FALSE;
+    }
+return TRUE;
+}
+
+static void posCloseWrap(void *pFile)
+{
+struct twoBitPosFile **pPf = pFile, *pf = *pPf;
+if (pf != NULL)
+    {
+    if (pf->funcs.close != NULL)
+	(*pf->funcs.close)(pf->data);
+    freeMem(pf->fileName);
+    freez(pPf);
+    }
+}
+
+static struct twoBitPosFile *posFileNew(const char *name, const struct twoBitIOFuncs *funcs,
+	void *data)
+/* Return a file read through funcs. */
+{
+struct twoBitPosFile *pf;
+bits64 size;
+if (funcs->readAt == NULL || funcs->size == NULL)
+    errAbort("the readAt and size routines are required to open %s", name);
+if (!(*funcs->size)(data, &size))
+    errAbort("Can't get the size of %s", name);
+AllocVar(pf);
+pf->funcs = *funcs;
+pf->data = data;
+pf->size = size;
+pf->fileName = cloneString(name);
+return pf;
+}
+
+#ifndef _WIN32
+static boolean fileSizeWrap(void *file, bits64 *retSize)
+{
+struct stat st;
+if (fstat(fileno((FILE *)file), &st) < 0)
+    return FALSE;
+*retSize = st.st_size;
+return TRUE;
+}
+
+static void fileCloseDataWrap(void *file)
+{
+FILE *f = file;
+carefulClose(&f);
+}
+
+static const struct twoBitIOFuncs preadFuncs =
+/* The routines of a twoBitPosFile read with pread(). */
+    {
+    readAtWrap, fileSizeWrap, NULL, fileCloseDataWrap,
+    };
+
+static struct twoBitPosFile *posFileOpen(const char *fileName)
+/* Open file for reading with pread(). */
+{
+return posFileNew(fileName, &preadFuncs, mustOpen(fileName, "rb"));
+}
+#endif
+
+static void setPosFileFuncs(struct twoBitFile *tbf)
+/* Install the function pointers for a twoBit read with positional reads. */
+{
+tbf->ourSeekCur = posSeekCurWrap;
+tbf->ourSeek = posSeekWrap;
+tbf->ourTell = posTellWrap;
+tbf->ourReadBits32 = posReadBits32Wrap;
+tbf->ourReadBits64 = posReadBits64Wrap;
+tbf->ourFastReadString = posFastReadStringWrap;
+tbf->ourClose = posCloseWrap;
+tbf->ourMustRead = posMustReadWrap;
+tbf->ourRead = posReadWrap;
+tbf->ourReadAt = posReadAtWrap;
+tbf->ourReadAtv = posReadAtvWrap;
+}
+
 static void setFileFuncs( struct twoBitFile *tbf, boolean useUdc)
 /* choose the proper function pointers depending on whether
  * this open twoBit is using stdio or UDC
@@ -73,171 +506,431 @@ else
     tbf->ourFastReadString = fastReadStringWrap;
     tbf->ourClose = fileCloseWrap;
     tbf->ourMustRead = mustReadWrap;
+    tbf->ourRead = readWrap;
+#ifndef _WIN32
+    tbf->ourReadAt = readAtWrap;
+#endif
     }
 }
 
-static int countBlocksOfN(const char *s, int size)
-/* Count number of blocks of N's (or n's) in s. */
+/* The tbf* functions below go through the routines of tbf and count what
+ * they do in tbf->stats. */
+
+static void tbfSeek(struct twoBitFile *tbf, bits64 offset)
+/* Seek to offset. */
 {
-int i;
-boolean isN, lastIsN = FALSE;
-char c;
-int blockCount = 0;
+tbf->stats.seekCount += 1;
+(*tbf->ourSeek)(tbf->f, offset);
+}
 
-for (i=0; i<size; ++i)
+static void tbfSeekCur(struct twoBitFile *tbf, bits64 offset)
+/* Seek offset bytes forward from current position. */
+{
+tbf->stats.seekCount += 1;
+(*tbf->ourSeekCur)(tbf->f, offset);
+}
+
+static void tbfMustRead(struct twoBitFile *tbf, void *buf, size_t size)
+/* Read size bytes or die. */
+{
+tbf->stats.readCount += 1;
+tbf->stats.bytesRead += size;
+(*tbf->ourMustRead)(tbf->f, buf, size);
+}
+
+static size_t tbfRead(struct twoBitFile *tbf, void *buf, size_t size)
+/* Read up to size bytes, fewer only at end of file. */
+{
+size_t actualSize = (*tbf->ourRead)(tbf->f, buf, size);
+tbf->stats.readCount += 1;
+tbf->stats.bytesRead += actualSize;
+return actualSize;
+}
+
+static bits32 tbfReadBits32(struct twoBitFile *tbf, boolean isSwapped)
+/* Read a 32 bit entity. */
+{
+tbf->stats.readCount += 1;
+tbf->stats.bytesRead += sizeof(bits32);
+return (*tbf->ourReadBits32)(tbf->f, isSwapped);
+}
+
+static UBYTE *tbfMapAt(struct twoBitFile *tbf, struct twoBitIOStats *stats,
+	bits64 offset, size_t size)
+/* Fetch size bytes at offset of a file in memory, counting it in stats,
+ * which is tbf->stats or the stats of a reader on tbf. */
+{
+stats->readCount += 1;
+stats->bytesRead += size;
+return (*tbf->ourMapAt)(tbf->f, offset, size);
+}
+
+static boolean tbfReadAt(struct twoBitFile *tbf, bits64 offset, void *buf, size_t size)
+/* Read size bytes at offset.  Returns FALSE rather than abort on error.  Where
+ * tbf has no positional reads (stdio on Windows) this seeks tbf->f, which is
+ * then a FILE. */
+{
+tbf->stats.readCount += 1;
+tbf->stats.bytesRead += size;
+if (tbf->ourReadAt != NULL)
+    return (*tbf->ourReadAt)(tbf->f, offset, buf, size);
+tbf->stats.seekCount += 1;
+return fseek((FILE *)tbf->f, offset, SEEK_SET) == 0 &&
+	fread(buf, size, 1, (FILE *)tbf->f) == 1;
+}
+
+static boolean tbfReadAtv(struct twoBitFile *tbf, const struct twoBitIOVec *vecs, int count)
+/* Read the count ranges of vecs, all at once if tbf can (which counts as a
+ * single read), otherwise with a read at offset for each.  Returns FALSE if a
+ * read fails, so the caller can clean up before aborting. */
+{
+int i;
+if (tbf->ourReadAtv == NULL)
     {
-    c = s[i];
-    isN = (c == 'n' || c == 'N');
-    if (isN && !lastIsN)
-	++blockCount;
-    lastIsN = isN;
+    for (i = 0; i < count; ++i)
+	if (!tbfReadAt(tbf, vecs[i].offset, vecs[i].buf, vecs[i].size))
+	    return FALSE;
+    return TRUE;
     }
-return blockCount;
+tbf->stats.readCount += 1;
+for (i = 0; i < count; ++i)
+    tbf->stats.bytesRead += vecs[i].size;
+return (*tbf->ourReadAtv)(tbf->f, vecs, count);
 }
 
-static int countBlocksOfLower(const char *s, int size)
-/* Count number of blocks of lower case letters. */
+static bits64 monotonicNanos()
+/* Return reading of a monotonic clock in nanoseconds. */
 {
-int i;
-boolean isLower, lastIsLower = FALSE;
-int blockCount = 0;
+#ifdef _WIN32
+/* clock() measures wall time rather than CPU time on Windows. */
+return (bits64)clock() * (1000000000 / CLOCKS_PER_SEC);
+#else
+struct timespec ts;
+clock_gettime(CLOCK_MONOTONIC, &ts);
+return (bits64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
 
-for (i=0; i<size; ++i)
+void twoBitIOStatsClear(struct twoBitIOStats *stats)
+/* Zero the counters of stats. */
+{
+boolean timeDecode = stats->timeDecode;
+ZeroVar(stats);
+stats->timeDecode = timeDecode;
+}
+
+void twoBitIOStatsAdd(struct twoBitIOStats *sum, const struct twoBitIOStats *stats)
+/* Add the counters of stats to those of sum. */
+{
+sum->seekCount += stats->seekCount;
+sum->readCount += stats->readCount;
+sum->bytesRead += stats->bytesRead;
+sum->headerHits += stats->headerHits;
+sum->headerMisses += stats->headerMisses;
+sum->fragCount += stats->fragCount;
+sum->basesDecoded += stats->basesDecoded;
+sum->decodeNanos += stats->decodeNanos;
+}
+
+static int packedSize(int unpackedSize)
+/* Return size when packed, rounding up. */
+{
+return ((unpackedSize + 3) >> 2);
+}
+
+static void packerToggleBlock(bits32 **pStarts, bits32 **pSizes, bits32 *pCount,
+	bits32 *pAlloc, boolean *pInBlock, bits32 pos)
+/* Open a block at pos, or close the open one there.  The open block is
+ * the one at index *pCount, it gets counted when closed. */
+{
+if (*pInBlock)
     {
-    isLower = islower(s[i]);
-    if (isLower && !lastIsLower)
-	++blockCount;
-    lastIsLower = isLower;
+    (*pSizes)[*pCount] = pos - (*pStarts)[*pCount];
+    ++*pCount;
     }
-return blockCount;
+else
+    {
+    if (*pCount == *pAlloc)
+	{
+	bits32 newAlloc = (*pAlloc == 0) ? 64 : 2 * *pAlloc;
+	ExpandArray(*pStarts, *pAlloc, newAlloc);
+	ExpandArray(*pSizes, *pAlloc, newAlloc);
+	*pAlloc = newAlloc;
+	}
+    (*pStarts)[*pCount] = pos;
+    }
+*pInBlock = !*pInBlock;
 }
 
-static void storeBlocksOfN(const char *s, int size, bits32 *starts, bits32 *sizes)
-/* Store starts and sizes of blocks of N's. */
+static void packerRunsFromBits(struct twoBitPacker *p, bits32 bits, int count, boolean isN)
+/* Update blocks of N's (or of lower case) from bits, with bit i set if the
+ * letter at p->pos+i is an N (or lower case). */
 {
-int i;
-boolean isN, lastIsN = FALSE;
-int startN = 0;
-char c;
+struct twoBit *twoBit = p->twoBit;
+boolean *pInBlock = isN ? &p->inN : &p->inLower;
+bits32 all = (count == 32) ? 0xffffffff : ((1U << count) - 1);
+/* Bit i of changes is set if letter i is not in the same state as the one
+ * before it. */
+bits32 changes = (bits ^ ((bits << 1) | (*pInBlock ? 1 : 0))) & all;
+while (changes != 0)
+    {
+    int i = __builtin_ctz(changes);
+    if (isN)
+	packerToggleBlock(&twoBit->nStarts, &twoBit->nSizes, &twoBit->nBlockCount,
+		&p->nAlloc, pInBlock, p->pos + i);
+    else
+	packerToggleBlock(&twoBit->maskStarts, &twoBit->maskSizes, &twoBit->maskBlockCount,
+		&p->maskAlloc, pInBlock, p->pos + i);
+    changes &= changes - 1;
+    }
+}
 
+static void packerAddScalar(struct twoBitPacker *p, const DNA *dna, int size)
+/* Add size letters to packer one at a time.  Unless this is the last call
+ * size must be a multiple of 4. */
+{
+int i;
+bits32 nBits = 0, lowerBits = 0;
+UBYTE b = 0;
 for (i=0; i<size; ++i)
     {
-    c = s[i];
-    isN = (c == 'n' || c == 'N');
-    if (isN)
-        {
-	if (!lastIsN)
-	    startN = i;
+    char c = dna[i];
+    int bit = i & 31;
+    if (c == 'n' || c == 'N')
+	nBits |= (1U << bit);
+    if (c >= 'a' && c <= 'z')
+	lowerBits |= (1U << bit);
+    b = (b << 2) | ntValNoN[(int)(unsigned char)c];
+    if ((i&3) == 3)
+	{
+	*p->pt++ = b;
+	b = 0;
 	}
-    else
-        {
-	if (lastIsN)
-	    {
-	    *starts++ = startN;
-	    *sizes++ = i - startN;
-	    }
+    if (bit == 31 || i == size-1)
+	{
+	int count = bit + 1;
+	packerRunsFromBits(p, nBits, count, TRUE);
+	if (p->doMask)
+	    packerRunsFromBits(p, lowerBits, count, FALSE);
+	p->pos += count;
+	nBits = lowerBits = 0;
 	}
-    lastIsN = isN;
     }
-if (lastIsN)
+if ((size&3) != 0)
     {
-    *starts = startN;
-    *sizes = i - startN;
+    /* Pad last byte with T's. */
+    *p->pt++ = b << (8 - ((size&3) << 1));
     }
 }
 
-static void storeBlocksOfLower(const char *s, int size, bits32 *starts, bits32 *sizes)
-/* Store starts and sizes of blocks of lower case letters. */
+#if defined(__SSE2__)
+static int packerAddSimd(struct twoBitPacker *p, const DNA *dna, int size)
+/* Add as many letters as can be done 16 at a time with SSE2 to packer.
+ * Return number of letters added. */
 {
+const __m128i caseMask = _mm_set1_epi8((char)0xdf);
+const __m128i upA = _mm_set1_epi8('A'), upC = _mm_set1_epi8('C'), upG = _mm_set1_epi8('G');
+const __m128i upN = _mm_set1_epi8('N');
+const __m128i beforeA = _mm_set1_epi8('a'-1), afterZ = _mm_set1_epi8('z'+1);
+const __m128i valA = _mm_set1_epi8(A_BASE_VAL), valC = _mm_set1_epi8(C_BASE_VAL);
+const __m128i valG = _mm_set1_epi8(G_BASE_VAL);
+const __m128i byteMask = _mm_set1_epi32(0xff);
 int i;
-boolean isLower, lastIsLower = FALSE;
-int startLower = 0;
 
-for (i=0; i<size; ++i)
+for (i=0; i+16<=size; i += 16)
     {
-    isLower = islower(s[i]);
-    if (isLower)
-        {
-	if (!lastIsLower)
-	    startLower = i;
-	}
-    else
-        {
-	if (lastIsLower)
-	    {
-	    *starts++ = startLower;
-	    *sizes++ = i - startLower;
-	    }
+    __m128i c = _mm_loadu_si128((const __m128i *)(dna + i));
+    __m128i up = _mm_and_si128(c, caseMask);
+    bits32 nBits, lowerBits, packed4;
+
+    /* X_BASE_VAL of each letter, T_BASE_VAL (0) for anything not ACG. */
+    __m128i val = _mm_or_si128(_mm_or_si128(
+		_mm_and_si128(_mm_cmpeq_epi8(up, upA), valA),
+		_mm_and_si128(_mm_cmpeq_epi8(up, upC), valC)),
+		_mm_and_si128(_mm_cmpeq_epi8(up, upG), valG));
+
+    /* Each 32-bit lane holds 4 values, first one in the low byte: pack
+     * them into the low byte, first one in the high bits. */
+    __m128i b = _mm_or_si128(_mm_or_si128(
+		_mm_and_si128(_mm_slli_epi32(val, 6), _mm_set1_epi32(0xc0)),
+		_mm_and_si128(_mm_srli_epi32(val, 4), _mm_set1_epi32(0x30))),
+		_mm_or_si128(
+		_mm_and_si128(_mm_srli_epi32(val, 14), _mm_set1_epi32(0x0c)),
+		_mm_srli_epi32(val, 24)));
+    b = _mm_and_si128(b, byteMask);
+    b = _mm_packs_epi32(b, b);
+    b = _mm_packus_epi16(b, b);
+    packed4 = _mm_cvtsi128_si32(b);
+    memcpy(p->pt, &packed4, 4);
+    p->pt += 4;
+
+    nBits = _mm_movemask_epi8(_mm_cmpeq_epi8(up, upN));
+    if (nBits != 0 || p->inN)
+	packerRunsFromBits(p, nBits, 16, TRUE);
+    if (p->doMask)
+	{
+	lowerBits = _mm_movemask_epi8(_mm_and_si128(_mm_cmpgt_epi8(c, beforeA),
+						    _mm_cmplt_epi8(c, afterZ)));
+	if (lowerBits != 0 || p->inLower)
+	    packerRunsFromBits(p, lowerBits, 16, FALSE);
 	}
-    lastIsLower = isLower;
+    p->pos += 16;
     }
-if (lastIsLower)
+return i;
+}
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+static int packerAddSimd(struct twoBitPacker *p, const DNA *dna, int size)
+/* Add as many letters as can be done 16 at a time with NEON to packer.
+ * Return number of letters added. */
+{
+const uint8x16_t caseMask = vdupq_n_u8(0xdf);
+const uint8x16_t upA = vdupq_n_u8('A'), upC = vdupq_n_u8('C'), upG = vdupq_n_u8('G');
+const uint8x16_t upN = vdupq_n_u8('N');
+const uint8x16_t lowA = vdupq_n_u8('a'), lowZ = vdupq_n_u8('z');
+const uint8x16_t valA = vdupq_n_u8(A_BASE_VAL), valC = vdupq_n_u8(C_BASE_VAL);
+const uint8x16_t valG = vdupq_n_u8(G_BASE_VAL);
+static const UBYTE bitWeights[16] = {1,2,4,8,16,32,64,128, 1,2,4,8,16,32,64,128};
+const uint8x16_t weights = vld1q_u8(bitWeights);
+int i;
+
+for (i=0; i+16<=size; i += 16)
     {
-    *starts = startLower;
-    *sizes = i - startLower;
+    uint8x16_t c = vld1q_u8((const uint8_t *)(dna + i));
+    uint8x16_t up = vandq_u8(c, caseMask);
+    uint8x16_t isN, isLower;
+    bits32 packed4;
+
+    /* X_BASE_VAL of each letter, T_BASE_VAL (0) for anything not ACG. */
+    uint8x16_t val = vorrq_u8(vorrq_u8(
+		vandq_u8(vceqq_u8(up, upA), valA),
+		vandq_u8(vceqq_u8(up, upC), valC)),
+		vandq_u8(vceqq_u8(up, upG), valG));
+
+    /* Each 32-bit lane holds 4 values, first one in the low byte: pack
+     * them into the low byte, first one in the high bits. */
+    uint32x4_t v = vreinterpretq_u32_u8(val);
+    uint32x4_t b = vorrq_u32(vorrq_u32(
+		vandq_u32(vshlq_n_u32(v, 6), vdupq_n_u32(0xc0)),
+		vandq_u32(vshrq_n_u32(v, 4), vdupq_n_u32(0x30))),
+		vorrq_u32(
+		vandq_u32(vshrq_n_u32(v, 14), vdupq_n_u32(0x0c)),
+		vshrq_n_u32(v, 24)));
+    uint16x4_t b16 = vmovn_u32(b);
+    uint8x8_t b8 = vmovn_u16(vcombine_u16(b16, b16));
+    packed4 = vget_lane_u32(vreinterpret_u32_u8(b8), 0);
+    memcpy(p->pt, &packed4, 4);
+    p->pt += 4;
+
+    /* Turn lane masks into bit masks, bit i for lane i. */
+    isN = vandq_u8(vceqq_u8(up, upN), weights);
+    if (vmaxvq_u8(isN) != 0 || p->inN)
+	packerRunsFromBits(p, vaddv_u8(vget_low_u8(isN)) | (vaddv_u8(vget_high_u8(isN)) << 8),
+		16, TRUE);
+    if (p->doMask)
+	{
+	isLower = vandq_u8(vandq_u8(vcgeq_u8(c, lowA), vcleq_u8(c, lowZ)), weights);
+	if (vmaxvq_u8(isLower) != 0 || p->inLower)
+	    packerRunsFromBits(p,
+		vaddv_u8(vget_low_u8(isLower)) | (vaddv_u8(vget_high_u8(isLower)) << 8),
+		16, FALSE);
+	}
+    p->pos += 16;
     }
+return i;
 }
-
-static int packedSize(int unpackedSize)
-/* Return size when packed, rounding up. */
+#else
+static int packerAddSimd(struct twoBitPacker *p, const DNA *dna, int size)
+/* No SIMD available, leave it all to packerAddScalar(). */
 {
-return ((unpackedSize + 3) >> 2);
+return 0;
 }
+#endif
 
-struct twoBit *twoBitFromDnaSeq(struct dnaSeq *seq, boolean doMask)
-/* Convert dnaSeq representation in memory to twoBit representation.
- * If doMask is true interpret lower-case letters as masked. */
+struct twoBitPacker *twoBitPackerNew(char *name, int size, boolean doMask)
+/* Start converting a sequence of size letters to twoBit representation.
+ * Feed it the letters with twoBitPackerAdd() in pieces of any size, and
+ * get the result with twoBitPackerFinish().  If doMask is true interpret
+ * lower-case letters as masked. */
 {
-int ubyteSize = packedSize(seq->size);
-UBYTE *pt;
+struct twoBitPacker *packer;
 struct twoBit *twoBit;
-DNA last4[4];	/* Holds few bases. */
-const DNA *dna;
-int i, end;
 
 /* Allocate structure and fill in name. */
 AllocVar(twoBit);
-pt = AllocArray(twoBit->data, ubyteSize);
-twoBit->name = cloneString(seq->name);
-twoBit->size = seq->size;
+AllocArray(twoBit->data, packedSize(size));
+twoBit->name = cloneString(name);
+twoBit->size = size;
 
-/* Convert to 4-bases per byte representation. */
-dna = seq->dna;
-end = seq->size - 4;
-for (i=0; i<end; i += 4)
-    {
-    *pt++ = packDna4(dna+i);
-    }
+dnaUtilOpen();
+AllocVar(packer);
+packer->twoBit = twoBit;
+packer->pt = twoBit->data;
+packer->doMask = doMask;
+return packer;
+}
 
-/* Take care of conversion of last few bases. */
-last4[0] = last4[1] = last4[2] = last4[3] = 'T';
-memcpy(last4, dna+i, seq->size-i);
-*pt = packDna4(last4);
+void twoBitPackerAdd(struct twoBitPacker *packer, const char *dna, int size)
+/* Pack the next size letters of the sequence. */
+{
+int done, bulk;
 
-/* Deal with blocks of N. */
-twoBit->nBlockCount = countBlocksOfN(dna, seq->size);
-if (twoBit->nBlockCount > 0)
-    {
-    AllocArray(twoBit->nStarts, twoBit->nBlockCount);
-    AllocArray(twoBit->nSizes, twoBit->nBlockCount);
-    storeBlocksOfN(dna, seq->size, twoBit->nStarts, twoBit->nSizes);
-    }
+if (packer->pos + packer->carryCount + size > packer->twoBit->size)
+    errAbort("more than %d bases in sequence %s", packer->twoBit->size,
+	    packer->twoBit->name);
 
-/* Deal with masking */
-if (doMask)
+/* Complete the packed byte left over from last time. */
+if (packer->carryCount > 0)
     {
-    twoBit->maskBlockCount = countBlocksOfLower(dna, seq->size);
-    if (twoBit->maskBlockCount > 0)
-        {
-	AllocArray(twoBit->maskStarts, twoBit->maskBlockCount);
-	AllocArray(twoBit->maskSizes, twoBit->maskBlockCount);
-	storeBlocksOfLower(dna, seq->size, 
-		twoBit->maskStarts, twoBit->maskSizes);
+    while (packer->carryCount < 4 && size > 0)
+	{
+	packer->carry[packer->carryCount++] = *dna++;
+	--size;
 	}
+    if (packer->carryCount < 4)
+	return;
+    packerAddScalar(packer, packer->carry, 4);
+    packer->carryCount = 0;
     }
+
+/* Pack as many whole bytes as we can and keep the rest for next time. */
+done = packerAddSimd(packer, dna, size);
+bulk = (size - done) & ~3;
+packerAddScalar(packer, dna + done, bulk);
+done += bulk;
+packer->carryCount = size - done;
+memcpy(packer->carry, dna + done, packer->carryCount);
+}
+
+struct twoBit *twoBitPackerFinish(struct twoBitPacker **pPacker)
+/* Return the packed sequence and free up packer. */
+{
+struct twoBitPacker *packer = *pPacker;
+struct twoBit *twoBit = packer->twoBit;
+
+packerAddScalar(packer, packer->carry, packer->carryCount);
+if (packer->pos != twoBit->size)
+    errAbort("expected %d bases in sequence %s, got %d", twoBit->size, twoBit->name,
+	    (int)packer->pos);
+if (packer->inN)
+    packerToggleBlock(&twoBit->nStarts, &twoBit->nSizes, &twoBit->nBlockCount,
+	    &packer->nAlloc, &packer->inN, twoBit->size);
+if (packer->inLower)
+    packerToggleBlock(&twoBit->maskStarts, &twoBit->maskSizes, &twoBit->maskBlockCount,
+	    &packer->maskAlloc, &packer->inLower, twoBit->size);
+freez(pPacker);
 return twoBit;
 }
 
+struct twoBit *twoBitFromDnaSeq(struct dnaSeq *seq, boolean doMask)
+/* Convert dnaSeq representation in memory to twoBit representation.
+ * If doMask is true interpret lower-case letters as masked. */
+{
+/* Pack bases and find blocks of N's and lower case in a single pass. */
+struct twoBitPacker *packer = twoBitPackerNew(seq->name, seq->size, doMask);
+twoBitPackerAdd(packer, seq->dna, seq->size);
+return twoBitPackerFinish(&packer);
+}
+
 
 static int twoBitSizeInFile(struct twoBit *twoBit)
 /* Figure out size structure will take in file. */
@@ -357,30 +1050,379 @@ int twoBitWriteHeader(struct twoBit *twoBitList, FILE *f, const char **msg)
 return twoBitWriteHeaderExt(twoBitList, f, FALSE, msg);
 }
 
-void twoBitClose(struct twoBitFile **pTbf)
-/* Free up resources associated with twoBitFile. */
+static void writerWriteIndex(struct twoBitWriter *writer)
+/* Write out index of writer, with offsets of sequences not written yet set
+ * to 0. */
 {
-struct twoBitFile *tbf = *pTbf;
-if (tbf != NULL)
+int i;
+for (i=0; i<writer->seqCount; ++i)
     {
-    twoBitFree(&tbf->seqCache);
-    freez(&tbf->fileName);
-    (*tbf->ourClose)(&tbf->f);
-    hashFree(&tbf->hash);
-    /* The indexList is allocated out of the hash's memory pool. */
-    //bptFileClose(&tbf->bpt);
-    freez(pTbf);
+    bits64 longOffset = (i < writer->seqsWritten) ? writer->offsets[i] : 0;
+    writeString(writer->f, writer->names[i]);
+    if (writer->useLong)
+	writeOne(writer->f, longOffset);
+    else
+	{
+	bits32 offset = longOffset;
+	writeOne(writer->f, offset);
+	}
     }
 }
 
-boolean twoBitSigRead(struct twoBitFile *tbf, boolean *isSwapped)
-/* read twoBit signature, return FALSE if not good 
+struct twoBitWriter *twoBitWriterOpen(FILE *f, char **names, int seqCount,
+	boolean useLong, const char **msg)
+/* Start writing a twoBit file with seqCount sequences to f.  The names are
+ * needed up front because the index comes first in the file.  Add the
+ * sequences with twoBitWriterAdd() in the same order as names, and finish
+ * with twoBitWriterClose().  If useLong is True, use 64 bit quantities for
+ * the index offsets to support >4Gb assemblies.  Return NULL with *msg set
+ * if a name is too long. */
+{
+static char msg_buf[300];
+struct twoBitWriter *writer;
+bits32 sig = twoBitSig;
+bits32 version = useLong ? 1 : 0;
+bits32 count = seqCount;
+bits32 reserved = 0;
+bits64 offset;
+int i;
+
+*msg = msg_buf;
+offset = sizeof(sig) + sizeof(version) + sizeof(count) + sizeof(reserved);
+for (i=0; i<seqCount; ++i)
+    {
+    int nameLen = strlen(names[i]);
+    if (nameLen > 255)
+        {
+        snprintf(msg_buf, sizeof(msg_buf),
+                 "sequence name too long: %s", names[i]);
+        return NULL;
+        }
+    offset += nameLen + 1 + (useLong ? sizeof(bits64) : sizeof(bits32));
+    }
+
+AllocVar(writer);
+writer->f = f;
+writer->useLong = useLong;
+writer->seqCount = seqCount;
+if (seqCount > 0)	/* needLargeZeroedMem() doesn't like 0 bytes. */
+    {
+    AllocArray(writer->names, seqCount);
+    for (i=0; i<seqCount; ++i)
+	writer->names[i] = cloneString(names[i]);
+    AllocArray(writer->offsets, seqCount);
+    }
+writer->nextOffset = offset;
+
+/* Write out fixed parts of header, and index with the offsets left out. */
+writeOne(f, sig);
+writeOne(f, version);
+writeOne(f, count);
+writeOne(f, reserved);
+writerWriteIndex(writer);
+return writer;
+}
+
+int twoBitWriterAdd(struct twoBitWriter *writer, struct twoBit *twoBit,
+	const char **msg)
+/* Write out twoBit, which must be the next sequence named when writer was
+ * opened.  Return -1 if it is not, -2 if "index overflow" error (the
+ * sequence is not written then), 0 if everything ok. */
+{
+static char msg_buf[300];
+int size;
+
+*msg = msg_buf;
+if (writer->seqsWritten >= writer->seqCount
+ || !sameString(twoBit->name, writer->names[writer->seqsWritten]))
+    {
+    snprintf(msg_buf, sizeof(msg_buf),
+	     "unexpected sequence %s", twoBit->name);
+    return -1;
+    }
+size = twoBitSizeInFile(twoBit);
+if (!writer->useLong && (writer->dataSize + size > UINT_MAX))
+    {
+    snprintf(msg_buf, sizeof(msg_buf),
+	     "index overflow at sequence %s", twoBit->name);
+    return -2;
+    }
+twoBitWriteOne(twoBit, writer->f);
+writer->offsets[writer->seqsWritten++] = writer->nextOffset;
+writer->nextOffset += size;
+writer->dataSize += size;
+return 0;
+}
+
+void twoBitWriterFree(struct twoBitWriter **pWriter)
+/* Free up writer without finishing the file. */
+{
+struct twoBitWriter *writer = *pWriter;
+if (writer != NULL)
+    {
+    int i;
+    for (i=0; i<writer->seqCount; ++i)
+	freeMem(writer->names[i]);
+    freeMem(writer->names);
+    freeMem(writer->offsets);
+    freez(pWriter);
+    }
+}
+
+int twoBitWriterClose(struct twoBitWriter **pWriter, const char **msg)
+/* Fill in the offsets in the index and free up writer.  The file itself is
+ * left open, positioned at its end.  Return -1 if not all sequences were
+ * added, 0 if everything ok. */
+{
+static char msg_buf[300];
+struct twoBitWriter *writer = *pWriter;
+int ret = 0;
+
+*msg = msg_buf;
+if (writer->seqsWritten < writer->seqCount)
+    {
+    snprintf(msg_buf, sizeof(msg_buf),
+	     "sequence %s was not written", writer->names[writer->seqsWritten]);
+    ret = -1;
+    }
+else
+    {
+    mustSeek(writer->f, 4 * sizeof(bits32), SEEK_SET);
+    writerWriteIndex(writer);
+    mustSeek(writer->f, 0, SEEK_END);
+    }
+twoBitWriterFree(pWriter);
+return ret;
+}
+
+static void blockIndexFree(struct twoBitBlockIndex *bi)
+/* Free up the arrays of bi (but not bi itself). */
+{
+free(bi->firstBlock);
+free(bi->cumSizes);
+bi->firstBlock = bi->cumSizes = NULL;
+}
+
+static boolean blockIndexInit(struct twoBitBlockIndex *bi, bits32 seqSize,
+	int blockCount, const bits32 *starts, const bits32 *sizes)
+/* Build index of blocks of a sequence of seqSize bases, with about one block
+ * per bucket.  Returns FALSE if out of memory.  Doesn't abort so it can be
+ * used by readers. */
+{
+int i, b;
+ZeroVar(bi);
+bi->blockCount = blockCount;
+bi->starts = starts;
+bi->sizes = sizes;
+if (blockCount == 0)
+    return TRUE;
+/* Stop at 31 so a few blocks on a sequence of 2^31 bases or more don't
+ * shift seqSize by 32 or more, which C leaves undefined. */
+bi->bucketShift = 6;
+while (bi->bucketShift < 31 && ((bits64)seqSize >> bi->bucketShift) >= blockCount)
+    bi->bucketShift += 1;
+bi->bucketCount = ((bits64)seqSize >> bi->bucketShift) + 1;
+bi->firstBlock = malloc(bi->bucketCount * sizeof(bits32));
+bi->cumSizes = malloc((blockCount+1) * sizeof(bits32));
+if (bi->firstBlock == NULL || bi->cumSizes == NULL)
+    {
+    blockIndexFree(bi);
+    return FALSE;
+    }
+bi->cumSizes[0] = 0;
+for (i=0; i<blockCount; ++i)
+    bi->cumSizes[i+1] = bi->cumSizes[i] + sizes[i];
+for (b=0, i=0; b<bi->bucketCount; ++b)
+    {
+    bits64 pos = (bits64)b << bi->bucketShift;
+    while (i < blockCount && (bits64)starts[i] + sizes[i] <= pos)
+	++i;
+    bi->firstBlock[b] = i;
+    }
+return TRUE;
+}
+
+static int blockIndexFind(const struct twoBitBlockIndex *bi, int pos)
+/* Return index of first block ending after pos, or blockCount if there is
+ * none.  pos must be within the sequence. */
+{
+int i;
+if (bi->blockCount == 0)
+    return 0;
+i = bi->firstBlock[pos >> bi->bucketShift];
+while (i < bi->blockCount && bi->starts[i] + bi->sizes[i] <= pos)
+    ++i;
+return i;
+}
+
+static int blockIndexOverlap(const struct twoBitBlockIndex *bi, int start, int end,
+	int *retCount)
+/* Return index of first block overlapping start to end, and number of
+ * blocks overlapping it in *retCount. */
+{
+int startIx = blockIndexFind(bi, start);
+int endIx = blockIndexFind(bi, end);
+if (endIx < bi->blockCount && bi->starts[endIx] < end)
+    ++endIx;
+*retCount = (endIx > startIx ? endIx - startIx : 0);
+return startIx;
+}
+
+static int blockIndexCount(const struct twoBitBlockIndex *bi, int start, int end)
+/* Return number of bases from start to end covered by blocks. */
+{
+int ix, count;
+bits32 firstStart, lastEnd, total;
+ix = blockIndexOverlap(bi, start, end, &count);
+if (count == 0)
+    return 0;
+firstStart = bi->starts[ix];
+lastEnd = bi->starts[ix+count-1] + bi->sizes[ix+count-1];
+total = bi->cumSizes[ix+count] - bi->cumSizes[ix];
+if (firstStart < start)
+    total -= start - firstStart;
+if (lastEnd > end)
+    total -= lastEnd - end;
+return total;
+}
+
+static void cachedHeaderFree(struct twoBitCachedHeader **pEl)
+/* Free up a cached header and its block indexes. */
+{
+struct twoBitCachedHeader *el = *pEl;
+if (el != NULL)
+    {
+    blockIndexFree(&el->nIndex);
+    blockIndexFree(&el->maskIndex);
+    twoBitFree(&el->twoBit);
+    free(el);
+    *pEl = NULL;
+    }
+}
+
+static struct twoBitCachedHeader *headerCacheFind(struct twoBitHeaderCache *cache, char *name)
+/* Return cached header of named sequence, moved to the front of the cache,
+ * or NULL if it's not in the cache. */
+{
+struct twoBitCachedHeader *el, *prev = NULL;
+for (el = cache->list; el != NULL; prev = el, el = el->next)
+    {
+    if (sameString(el->twoBit->name, name))
+	{
+	if (prev != NULL)
+	    {
+	    prev->next = el->next;
+	    el->next = cache->list;
+	    cache->list = el;
+	    }
+	return el;
+	}
+    }
+return NULL;
+}
+
+static void headerCacheTrim(struct twoBitHeaderCache *cache)
+/* Evict least recently used headers until the cache is within its limits,
+ * always keeping the most recently used one. */
+{
+int maxCount = (cache->maxCount > 0 ? cache->maxCount : TWOBIT_HEADER_CACHE_COUNT);
+size_t maxBytes = (cache->maxBytes > 0 ? cache->maxBytes : TWOBIT_HEADER_CACHE_BYTES);
+while (cache->count > 1 && (cache->count > maxCount || cache->bytes > maxBytes))
+    {
+    struct twoBitCachedHeader **pEl = &cache->list;
+    while ((*pEl)->next != NULL)
+	pEl = &(*pEl)->next;
+    cache->count -= 1;
+    cache->bytes -= (*pEl)->bytes;
+    cachedHeaderFree(pEl);
+    }
+}
+
+static struct twoBitCachedHeader *headerCacheAdd(struct twoBitHeaderCache *cache,
+	struct twoBit *twoBit, bits64 dataOffset)
+/* Add header (without data) in front of the cache, which takes ownership of
+ * it, index its blocks, and evict old headers as needed.  Returns NULL (and
+ * frees twoBit) if out of memory.  Doesn't abort so it can be used by
+ * readers. */
+{
+struct twoBitCachedHeader *el = calloc(1, sizeof(*el));
+if (el == NULL)
+    {
+    twoBitFree(&twoBit);
+    return NULL;
+    }
+el->twoBit = twoBit;
+el->dataOffset = dataOffset;
+if (!blockIndexInit(&el->nIndex, twoBit->size,
+	twoBit->nBlockCount, twoBit->nStarts, twoBit->nSizes)
+ || !blockIndexInit(&el->maskIndex, twoBit->size,
+	twoBit->maskBlockCount, twoBit->maskStarts, twoBit->maskSizes))
+    {
+    cachedHeaderFree(&el);
+    return NULL;
+    }
+el->bytes = sizeof(*el) + sizeof(*twoBit)
+	+ 3 * sizeof(bits32) * ((size_t)twoBit->nBlockCount + twoBit->maskBlockCount)
+	+ sizeof(bits32) * ((size_t)el->nIndex.bucketCount + el->maskIndex.bucketCount);
+el->next = cache->list;
+cache->list = el;
+cache->count += 1;
+cache->bytes += el->bytes;
+headerCacheTrim(cache);
+return el;
+}
+
+static void headerCacheFree(struct twoBitHeaderCache *cache)
+/* Free up all headers in cache, keeping its limits. */
+{
+struct twoBitCachedHeader *el, *next;
+for (el = cache->list; el != NULL; el = next)
+    {
+    next = el->next;
+    cachedHeaderFree(&el);
+    }
+cache->list = NULL;
+cache->count = 0;
+cache->bytes = 0;
+}
+
+void twoBitClose(struct twoBitFile **pTbf)
+/* Free up resources associated with twoBitFile. */
+{
+struct twoBitFile *tbf = *pTbf;
+if (tbf != NULL)
+    {
+    headerCacheFree(&tbf->headerCache);
+    free(tbf->scratch);
+    freeMem(tbf->summary);
+    freez(&tbf->fileName);
+    (*tbf->ourClose)(&tbf->f);
+    hashFree(&tbf->hash);
+    /* The indexList is allocated out of the hash's memory pool. */
+    //bptFileClose(&tbf->bpt);
+    freez(pTbf);
+    }
+}
+
+void twoBitSetHeaderCache(struct twoBitFile *tbf, int maxCount, size_t maxBytes)
+/* Set the max number of sequence headers and the max memory used by them
+ * in the header cache of tbf (0 for the default).  Also applies to the
+ * readers created on tbf afterwards.  A maxCount of 1 only keeps the header
+ * of the last sequence accessed. */
+{
+tbf->headerCache.maxCount = maxCount;
+tbf->headerCache.maxBytes = maxBytes;
+headerCacheTrim(&tbf->headerCache);
+}
+
+boolean twoBitSigRead(struct twoBitFile *tbf, boolean *isSwapped)
+/* read twoBit signature, return FALSE if not good 
  * set isSwapped to TRUE if twoBit file is byte swapped */
 {
 bits32 sig;
 
 *isSwapped = FALSE;
-(*tbf->ourMustRead)(tbf->f, &sig, sizeof(sig));
+tbfMustRead(tbf, &sig, sizeof(sig));
 if (sig == twoBitSwapSig)
     *isSwapped = TRUE;
 else if (sig != twoBitSig)
@@ -404,63 +1446,213 @@ else
 return tbf;
 }
 
-static struct twoBitFile *twoBitOpenReadHeader(const char *fileName, boolean useUdc)
-/* Open file, read in header but not index.  
- * Squawk and die if there is a problem. */
+static struct twoBitFile *getTbfAndMmap(const char *fileName)
 {
 struct twoBitFile *tbf;
-boolean isSwapped = FALSE;
 
-tbf = getTbfAndOpen(fileName, useUdc);
+AllocVar(tbf);
+setMemFileFuncs(tbf);
+tbf->f = memFileMap(fileName);
+
+return tbf;
+}
 
-/* Allocate header verify signature, and read in
- * the constant-length bits. */
+static void twoBitReadHeader(struct twoBitFile *tbf, const char *fileName)
+/* Read in header but not index of already open file.
+ * Squawk and die if there is a problem. */
+{
+boolean isSwapped = FALSE;
 
+/* Verify signature, and read in the constant-length bits. */
 if (!twoBitSigRead(tbf, &isSwapped))
     errAbort("%s doesn't have a valid twoBitSig", fileName);
 
 tbf->isSwapped = isSwapped;
 tbf->fileName = cloneString(fileName);
-tbf->version = (*tbf->ourReadBits32)(tbf->f, isSwapped);
+tbf->version = tbfReadBits32(tbf, isSwapped);
 if ((tbf->version != 0) && (tbf->version != 1))
     {
     errAbort("Can only handle version 0 or version 1 of this file. This is version %d",
     	(int)tbf->version);
     }
-tbf->seqCount = (*tbf->ourReadBits32)(tbf->f, isSwapped);
-tbf->reserved = (*tbf->ourReadBits32)(tbf->f, isSwapped);
-return tbf;
+tbf->seqCount = tbfReadBits32(tbf, isSwapped);
+tbf->reserved = tbfReadBits32(tbf, isSwapped);
 }
 
+static struct twoBitFile *twoBitOpenReadHeader(const char *fileName, boolean useUdc)
+/* Open file, read in header but not index.  
+ * Squawk and die if there is a problem. */
+{
+struct twoBitFile *tbf = getTbfAndOpen(fileName, useUdc);
+twoBitReadHeader(tbf, fileName);
+return tbf;
+}
 
-struct twoBitFile *twoBitOpen(const char *fileName)
-/* Open file, read in header and index.  
+static void twoBitReadIndex(struct twoBitFile *tbf)
+/* Read in index of file whose header has just been read.  The index is
+ * read in big blocks and parsed in memory, rather than with two reads per
+ * sequence, into an array of entries that are also linked in file order.
  * Squawk and die if there is a problem. */
 {
-boolean useUdc = FALSE;
-struct twoBitFile *tbf = twoBitOpenReadHeader(fileName, useUdc);
+char *fileName = tbf->fileName;
 struct twoBitIndex *index;
 boolean isSwapped = tbf->isSwapped;
 int i;
 struct hash *hash;
-void *f = tbf->f;
+struct hashEl *hel;
+int offsetSize = (tbf->version == 1 ? sizeof(bits64) : sizeof(bits32));
+int maxEntrySize = 1 + 255 + offsetSize;
+size_t bufSize = 1024*1024, readSize, actualSize;
+size_t bufStart = 0, bufEnd = 0;
+bits64 indexSize = 0;
+boolean atEof = FALSE;
+UBYTE *buf;
 
 /* Read in index. */
 hash = tbf->hash = hashNew(digitsBaseTwo(tbf->seqCount));
+if (tbf->seqCount == 0)
+    return;
+lmAllocArray(hash->lm, tbf->indexArray, tbf->seqCount);
+buf = needLargeMem(bufSize);
+/* Guess the size of the index on the first read so that opening a file with
+ * a handful of sequences doesn't read a whole buffer of sequence data. */
+readSize = (size_t)tbf->seqCount * (1 + 32 + offsetSize);
 for (i=0; i<tbf->seqCount; ++i)
     {
-    char name[256];
-    if (!(*tbf->ourFastReadString)(f, name))
+    int nameSize;
+    if (bufEnd - bufStart < maxEntrySize && !atEof)
+        {
+	/* Refill buffer, keeping the partial entry at its end. */
+	memmove(buf, buf + bufStart, bufEnd - bufStart);
+	bufEnd -= bufStart;
+	bufStart = 0;
+	if (readSize > bufSize - bufEnd)
+	    readSize = bufSize - bufEnd;
+	actualSize = tbfRead(tbf, buf + bufEnd, readSize);
+	atEof = (actualSize < readSize);
+	bufEnd += actualSize;
+	readSize = bufSize;
+	}
+    if (bufStart == bufEnd || bufEnd - bufStart < 1 + buf[bufStart] + offsetSize)
+        {
+	freeMem(buf);
         errAbort("%s is truncated", fileName);
-    lmAllocVar(hash->lm, index);
+	}
+    nameSize = buf[bufStart];
+    index = tbf->indexArray + i;
+    bufStart += 1 + nameSize;
     if (tbf->version == 1)
-        index->offset = (*tbf->ourReadBits64)(f, isSwapped);
+        {
+	bits64 offset;
+	memcpy(&offset, buf + bufStart, sizeof(offset));
+	index->offset = (isSwapped ? byteSwap64(offset) : offset);
+	}
     else
-        index->offset = (*tbf->ourReadBits32)(f, isSwapped);
-    hashAddSaveName(hash, name, index, &index->name);
-    slAddHead(&tbf->indexList, index);
+        {
+	bits32 offset;
+	memcpy(&offset, buf + bufStart, sizeof(offset));
+	index->offset = (isSwapped ? byteSwap32(offset) : offset);
+	}
+    /* The offset has been read so its first byte can be overwritten to
+     * zero-terminate the name, which hashAddN() needs to hash it. */
+    buf[bufStart] = 0;
+    hel = hashAddN(hash, (char *)buf + bufStart - nameSize, nameSize, index);
+    index->name = hel->name;
+    bufStart += offsetSize;
+    indexSize += 1 + nameSize + offsetSize;
+    index->next = (i+1 < tbf->seqCount ? index + 1 : NULL);
     }
-slReverse(&tbf->indexList);
+freeMem(buf);
+tbf->indexList = tbf->indexArray;
+/* Leave the file positioned at the end of the index, like reading the
+ * entries one at a time does. */
+tbfSeek(tbf, 16 + indexSize);
+}
+
+static void twoBitAttachSummary(struct twoBitFile *tbf)
+/* Use summary file of tbf if there is an up to date one. */
+{
+char *fileName = twoBitSummaryFileName(tbf->fileName);
+tbf->summary = twoBitSummaryRead(tbf, fileName);
+freeMem(fileName);
+}
+
+struct twoBitFile *twoBitOpen(const char *fileName)
+/* Open file, read in header and index.  
+ * Squawk and die if there is a problem. */
+{
+boolean useUdc = FALSE;
+struct twoBitFile *tbf = twoBitOpenReadHeader(fileName, useUdc);
+twoBitReadIndex(tbf);
+twoBitAttachSummary(tbf);
+return tbf;
+}
+
+struct twoBitFile *twoBitOpenMmap(const char *fileName)
+/* Like twoBitOpen() but map the whole file into memory, so that sequence
+ * data is served as pointers into the mapping rather than with a seek and
+ * a read for each fragment.  Where mmap() is not available (Windows) the
+ * file is read into memory in whole instead.  Close with twoBitClose(). */
+{
+struct twoBitFile *tbf = getTbfAndMmap(fileName);
+twoBitReadHeader(tbf, fileName);
+twoBitReadIndex(tbf);
+twoBitAttachSummary(tbf);
+return tbf;
+}
+
+struct twoBitFile *twoBitOpenMem(const char *name, const void *data, bits64 size)
+/* Like twoBitOpen() but on a .2bit file image of size bytes at data (e.g.
+ * a file downloaded into memory), read with the same routines as the
+ * mapping of twoBitOpenMmap().  The image is not copied so it must stay in
+ * place and unchanged until twoBitClose().  name is only used in error
+ * messages (no summary file is looked for).  Close with twoBitClose(). */
+{
+struct twoBitFile *tbf;
+AllocVar(tbf);
+setMemFileFuncs(tbf);
+tbf->f = memFileWrap(name, data, size);
+twoBitReadHeader(tbf, name);
+twoBitReadIndex(tbf);
+return tbf;
+}
+
+struct twoBitFile *twoBitOpenPositional(const char *fileName)
+/* Like twoBitOpen() but read the file with pread() at a read position kept
+ * in tbf rather than with stdio, so that a tbf inherited by a forked child
+ * process can be used by both the child and its parent.  Where pread() is
+ * not available (Windows) this is the same as twoBitOpen(). */
+{
+#ifdef _WIN32
+return twoBitOpen(fileName);
+#else
+struct twoBitFile *tbf;
+AllocVar(tbf);
+setPosFileFuncs(tbf);
+tbf->f = posFileOpen(fileName);
+twoBitReadHeader(tbf, fileName);
+twoBitReadIndex(tbf);
+twoBitAttachSummary(tbf);
+return tbf;
+#endif
+}
+
+struct twoBitFile *twoBitOpenCallbacks(const char *name, const struct twoBitIOFuncs *funcs,
+	void *data)
+/* Like twoBitOpen() but read the file through the routines of funcs (which
+ * is copied), called with data, e.g. to read it from remote storage through
+ * a cache.  Reads are done at a read position kept in tbf like with
+ * twoBitOpenPositional(), and small ones are served from a read-ahead
+ * buffer.  name is only used in error messages.  data is released with
+ * funcs->close by twoBitClose(), but not if opening the file fails. */
+{
+struct twoBitFile *tbf;
+struct twoBitPosFile *pf = posFileNew(name, funcs, data);
+AllocVar(tbf);
+setPosFileFuncs(tbf);
+tbf->f = pf;
+twoBitReadHeader(tbf, name);
+twoBitReadIndex(tbf);
 return tbf;
 }
 
@@ -479,7 +1671,7 @@ return tbf;
 //return tbf;
 //}
 
-static int findGreatestLowerBound(int blockCount, bits32 *pos, 
+static int findGreatestLowerBound(int blockCount, const bits32 *pos, 
 	int val)
 /* Find index of greatest element in posArray that is less 
  * than or equal to val using a binary search. */
@@ -536,7 +1728,7 @@ static void twoBitSeekTo(struct twoBitFile *tbf, char *name)
     struct twoBitIndex *index = hashFindVal(tbf->hash, name);
     if (index == NULL)
 	 errAbort("%s is not in %s", name, tbf->fileName);
-    (*tbf->ourSeek)(tbf->f, index->offset);
+    tbfSeek(tbf, index->offset);
     }
 }
 
@@ -545,7 +1737,7 @@ static void readBlockCoords(struct twoBitFile *tbf, boolean isSwapped, bits32 *r
 /* Read in blockCount, starts and sizes from file. (Same structure used for
  * both blocks of N's and masked blocks.) */
 {
-bits32 blkCount = (*tbf->ourReadBits32)(tbf->f, isSwapped);
+bits32 blkCount = tbfReadBits32(tbf, isSwapped);
 *retBlockCount = blkCount;
 if (blkCount == 0)
     {
@@ -557,8 +1749,8 @@ else
     bits32 *nStarts, *nSizes;
     AllocArray(nStarts, blkCount);
     AllocArray(nSizes, blkCount);
-    (*tbf->ourMustRead)(tbf->f, nStarts, sizeof(nStarts[0]) * blkCount);
-    (*tbf->ourMustRead)(tbf->f, nSizes, sizeof(nSizes[0]) * blkCount);
+    tbfMustRead(tbf, nStarts, sizeof(nStarts[0]) * blkCount);
+    tbfMustRead(tbf, nSizes, sizeof(nSizes[0]) * blkCount);
     if (isSwapped)
 	{
 	int i;
@@ -581,293 +1773,1167 @@ boolean isSwapped = tbf->isSwapped;
 struct twoBit *twoBit;
 AllocVar(twoBit);
 twoBit->name = cloneString(name);
-void *f = tbf->f;
 
-/* Find offset in index and seek to it */
-twoBitSeekTo(tbf, name);
+/* Find offset in index and seek to it */
+twoBitSeekTo(tbf, name);
+
+/* Read in seqSize. */
+twoBit->size = tbfReadBits32(tbf, isSwapped);
+
+/* Read in blocks of N. */
+readBlockCoords(tbf, isSwapped, &(twoBit->nBlockCount),
+		&(twoBit->nStarts), &(twoBit->nSizes));
+
+/* Read in masked blocks. */
+readBlockCoords(tbf, isSwapped, &(twoBit->maskBlockCount),
+		&(twoBit->maskStarts), &(twoBit->maskSizes));
+
+/* Reserved word. */
+twoBit->reserved = tbfReadBits32(tbf, isSwapped);
+
+return twoBit;
+}
+
+struct twoBit *twoBitOneFromFile(struct twoBitFile *tbf, char *name)
+/* Get single sequence as two bit. */
+{
+struct twoBit *twoBit = readTwoBitSeqHeader(tbf, name);
+bits32 packByteCount;
+
+/* Read in data. */
+packByteCount = packedSize(twoBit->size);
+twoBit->data = needLargeMem(packByteCount);
+tbfMustRead(tbf, twoBit->data, packByteCount);
+
+return twoBit;
+}
+
+struct twoBit *twoBitFromOpenFile(struct twoBitFile *tbf)
+/* Get twoBit list of all sequences in twoBit file. */
+{
+struct twoBitIndex *index;
+struct twoBit *twoBitList = NULL;
+
+for (index = tbf->indexList; index != NULL; index = index->next)
+    {
+    struct twoBit *twoBit = twoBitOneFromFile(tbf, index->name);
+    slAddHead(&twoBitList, twoBit);
+    }
+
+twoBitClose(&tbf);
+slReverse(&twoBitList);
+return twoBitList;
+}
+
+struct twoBit *twoBitFromFile(const char *fileName)
+/* Get twoBit list of all sequences in already open twoBit file. */
+{
+struct twoBitFile *tbf = twoBitOpen(fileName);
+
+return twoBitFromOpenFile(tbf);
+}
+
+
+void twoBitFree(struct twoBit **pTwoBit)
+/* Free up a two bit structure. */
+{
+struct twoBit *twoBit = *pTwoBit;
+if (twoBit != NULL)
+    {
+    freeMem(twoBit->nStarts);
+    freeMem(twoBit->nSizes);
+    freeMem(twoBit->maskStarts);
+    freeMem(twoBit->maskSizes);
+    freeMem(twoBit->data);
+    freez(pTwoBit);
+    }
+}
+
+void twoBitFreeList(struct twoBit **pList)
+/* Free a list of dynamically allocated twoBit's */
+{
+struct twoBit *el, *next;
+
+for (el = *pList; el != NULL; el = next)
+    {
+    next = el->next;
+    twoBitFree(&el);
+    }
+*pList = NULL;
+}
+
+static struct twoBitCachedHeader *getTwoBitSeqHeader(struct twoBitFile *tbf, char *name)
+/* get the sequence header information and block indexes using the cache.
+ * Position file right at data. */
+{
+struct twoBitCachedHeader *cached = headerCacheFind(&tbf->headerCache, name);
+if (cached != NULL)
+    {
+    // use cached
+    tbf->stats.headerHits += 1;
+    tbfSeek(tbf, cached->dataOffset);
+    }
+else
+    {
+    // fetch new and cache
+    tbf->stats.headerMisses += 1;
+    struct twoBit *twoBit = readTwoBitSeqHeader(tbf, name);
+    struct twoBitIndex *index = hashMustFindVal(tbf->hash, name);
+    /* Cached headers share the name of the index. */
+    freeMem(twoBit->name);
+    twoBit->name = index->name;
+    cached = headerCacheAdd(&tbf->headerCache, twoBit, (*tbf->ourTell)(tbf->f));
+    if (cached == NULL)
+	errAbort("out of memory");
+    }
+tbf->seqCache = cached->twoBit;
+tbf->dataOffsetCache = cached->dataOffset;
+return cached;
+}
+
+static UBYTE *packedBuffer(UBYTE **pScratch, size_t *pScratchSize, int packByteCount,
+	UBYTE **retAlloc)
+/* Return a buffer for packByteCount packed bytes: the scratch buffer, grown
+ * as needed, if packByteCount is at most TWOBIT_SCRATCH_MAX, otherwise a new
+ * buffer that is also returned in *retAlloc.  Returns NULL if out of
+ * memory.  Doesn't abort so it can be used by readers. */
+{
+*retAlloc = NULL;
+if (packByteCount > TWOBIT_SCRATCH_MAX)
+    return *retAlloc = malloc(packByteCount);
+if (packByteCount > *pScratchSize)
+    {
+    size_t newSize = max(4096, 2 * *pScratchSize);
+    while (newSize < packByteCount)
+	newSize *= 2;
+    if (newSize > TWOBIT_SCRATCH_MAX)
+	newSize = TWOBIT_SCRATCH_MAX;
+    free(*pScratch);
+    *pScratchSize = 0;
+    if ((*pScratch = malloc(newSize)) == NULL)
+	return NULL;
+    *pScratchSize = newSize;
+    }
+return *pScratch;
+}
+
+static UBYTE *readPackedBytes(struct twoBitFile *tbf, int packedStart, int packByteCount,
+	UBYTE **retAlloc)
+/* Return packByteCount packed bytes starting packedStart bytes into the data
+ * of the sequence whose header was just fetched with getTwoBitSeqHeader().
+ * If the file is in memory this is a pointer into it, otherwise the bytes
+ * are read into the scratch buffer of tbf (good until the next read) or, if
+ * there are too many of them, into a buffer that is also returned in
+ * *retAlloc and must be freed by the caller. */
+{
+UBYTE *packed;
+if (tbf->ourMapAt != NULL)
+    {
+    /* File is in memory, no need to copy the bits. */
+    *retAlloc = NULL;
+    packed = tbfMapAt(tbf, &tbf->stats, tbf->dataOffsetCache + packedStart, packByteCount);
+    if (packed == NULL)
+	errAbort("%s is truncated", tbf->fileName);
+    }
+else
+    {
+    packed = packedBuffer(&tbf->scratch, &tbf->scratchSize, packByteCount, retAlloc);
+    if (packed == NULL)
+	errAbort("out of memory - request size %d bytes", packByteCount);
+    tbfSeekCur(tbf, packedStart);
+    tbfMustRead(tbf, packed, packByteCount);
+    }
+return packed;
+}
+
+static void fillViewBlocks(const struct twoBitCachedHeader *cached,
+	struct twoBitPackedView *view)
+/* Point view at the blocks of cached header that overlap it. */
+{
+int ix;
+ix = blockIndexOverlap(&cached->nIndex, view->start, view->end, &view->nBlockCount);
+if (view->nBlockCount > 0)
+    {
+    view->nStarts = cached->nIndex.starts + ix;
+    view->nSizes = cached->nIndex.sizes + ix;
+    }
+ix = blockIndexOverlap(&cached->maskIndex, view->start, view->end, &view->maskBlockCount);
+if (view->maskBlockCount > 0)
+    {
+    view->maskStarts = cached->maskIndex.starts + ix;
+    view->maskSizes = cached->maskIndex.sizes + ix;
+    }
+}
+
+void twoBitReadPackedView(struct twoBitFile *tbf, char *name,
+	int fragStart, int fragEnd, struct twoBitPackedView *view)
+/* Fill in view with part of sequence in its packed 2-bit form, without
+ * decoding it.  To view the full sequence call with start=end=0.  For a file
+ * opened with twoBitOpenMmap() no bytes are copied, otherwise the packed
+ * bytes are read into a buffer of tbf that is reused by the next read (or
+ * into view->packedAlloc if there are more than TWOBIT_SCRATCH_MAX of them).
+ * The block arrays point into the sequence header cached in tbf so the view
+ * is only good until the next read from tbf.  Release with
+ * twoBitPackedViewFree(). */
+{
+struct twoBitCachedHeader *cached;
+struct twoBit *twoBit;
+int packedStart;
+
+/* set up tables needed by twoBitPackedViewUnpack(). */
+dnaUtilOpen();
+cached = getTwoBitSeqHeader(tbf, name);
+twoBit = cached->twoBit;
+
+/* validate range. */
+if (fragEnd == 0)
+    fragEnd = twoBit->size;
+if (fragEnd > twoBit->size)
+    errAbort("twoBitReadPackedView in %s end (%d) >= seqSize (%d)", name, fragEnd, twoBit->size);
+if (fragEnd - fragStart < 1)
+    errAbort("twoBitReadPackedView in %s start (%d) >= end (%d)", name, fragStart, fragEnd);
+
+ZeroVar(view);
+view->start = fragStart;
+view->end = fragEnd;
+view->seqSize = twoBit->size;
+packedStart = (fragStart>>2);
+view->packed = readPackedBytes(tbf, packedStart, ((fragEnd+3)>>2) - packedStart,
+	&view->packedAlloc);
+view->bitOffset = (fragStart&3) << 1;
+view->stats = &tbf->stats;
+
+fillViewBlocks(cached, view);
+}
+
+void twoBitReadPackedViews(struct twoBitFile *tbf, char *name, int count,
+	const int *starts, const int *ends, struct twoBitPackedView *views)
+/* Like twoBitReadPackedView() for count ranges of the same sequence, each
+ * with its own view, but with the packed bytes of all the ranges read at
+ * once if the file was opened with twoBitOpenCallbacks() (with a single
+ * call to funcs->readv) or twoBitOpenPositional().  A range is starts[i]
+ * to ends[i], which must not be empty.  Ranges sorted by start make for
+ * sequential reads.  The views are good until the next read from tbf.
+ * Release each with twoBitPackedViewFree(). */
+{
+struct twoBitCachedHeader *cached;
+struct twoBitIOVec *vecs = NULL;
+int i, packedStart, packByteCount;
+
+dnaUtilOpen();
+cached = getTwoBitSeqHeader(tbf, name);
+
+/* Validate all the ranges before allocating anything. */
+for (i = 0; i < count; ++i)
+    {
+    if (starts[i] < 0 || ends[i] > cached->twoBit->size || ends[i] - starts[i] < 1)
+	errAbort("twoBitReadPackedViews in %s invalid range %d-%d (seqSize is %d)",
+		name, starts[i], ends[i], cached->twoBit->size);
+    }
+if (tbf->ourMapAt == NULL && count > 0)
+    AllocArray(vecs, count);
+for (i = 0; i < count; ++i)
+    {
+    struct twoBitPackedView *view = views + i;
+    ZeroVar(view);
+    view->start = starts[i];
+    view->end = ends[i];
+    view->seqSize = cached->twoBit->size;
+    packedStart = (starts[i]>>2);
+    packByteCount = ((ends[i]+3)>>2) - packedStart;
+    if (vecs == NULL)
+	{
+	view->packed = tbfMapAt(tbf, &tbf->stats, cached->dataOffset + packedStart,
+		packByteCount);
+	if (view->packed == NULL)
+	    errAbort("%s is truncated", tbf->fileName);
+	}
+    else
+	{
+	view->packed = view->packedAlloc = needLargeMem(packByteCount);
+	vecs[i].offset = cached->dataOffset + packedStart;
+	vecs[i].buf = view->packedAlloc;
+	vecs[i].size = packByteCount;
+	}
+    view->bitOffset = (starts[i]&3) << 1;
+    view->stats = &tbf->stats;
+    fillViewBlocks(cached, view);
+    }
+if (vecs != NULL)
+    {
+    boolean ok = tbfReadAtv(tbf, vecs, count);
+    freeMem(vecs);
+    if (!ok)
+	{
+	for (i = 0; i < count; ++i)
+	    twoBitPackedViewFree(views + i);
+	errAbort("Error reading %d ranges from %s", count, tbf->fileName);
+	}
+    }
+}
+
+void twoBitPackedViewFree(struct twoBitPackedView *view)
+/* Free up resources held by view (but not view itself). */
+{
+freez(&view->packedAlloc);
+view->packed = NULL;
+}
+
+static void unpackFrag(const UBYTE *packed, int fragStart, int fragEnd,
+	boolean upper, boolean isRc, DNA *dna)
+/* Unpack bases fragStart to fragEnd into dna, given the packed bytes starting
+ * with the one that holds base fragStart, in upper case if upper is set and
+ * in lower case otherwise.  If isRc is set dna gets the reverse complement
+ * of the bases.  Blocks of N and masking are not applied. */
+{
+const DNA *table = (upper ? valToNtMasked : valToNt);
+int i, remainder, midStart, midEnd, midBytes;
+int packedStart = (fragStart>>2);
+int packByteCount = ((fragEnd+3)>>2) - packedStart;
+int comp = (isRc ? 2 : 0);	/* Complementing a base value flips this bit. */
+int step = (isRc ? -1 : 1);
+DNA *pt = (isRc ? dna + fragEnd - fragStart - 1 : dna);	/* Where next base goes. */
+
+/* Handle case where everything is in one packed byte */
+if (packByteCount == 1)
+    {
+    int pOff = (packedStart<<2);
+    int pStart = fragStart - pOff;
+    int pEnd = fragEnd - pOff;
+    UBYTE partial = *packed;
+    assert(pEnd <= 4);
+    assert(pStart >= 0);
+    for (i=pStart; i<pEnd; ++i, pt += step)
+	*pt = table[((partial >> (6-i-i)) & 3) ^ comp];
+    }
+else
+    {
+    /* Handle partial first packed byte. */
+    midStart = fragStart;
+    remainder = (fragStart&3);
+    if (remainder > 0)
+	{
+	UBYTE partial = *packed++;
+	for (i=remainder; i<4; ++i, pt += step)
+	    *pt = table[((partial >> (6-i-i)) & 3) ^ comp];
+	midStart += 4 - remainder;
+	}
+
+    /* Handle middle bytes. */
+    remainder = fragEnd&3;
+    midEnd = fragEnd - remainder;
+    midBytes = (midEnd - midStart) >> 2;
+    if (isRc)
+	unpackDna4RevComp(packed, midBytes, pt - (midEnd - midStart) + 1, upper);
+    else if (upper)
+	unpackDna4Upper(packed, midBytes, pt);
+    else
+	unpackDna4(packed, midBytes, pt);
+    packed += midBytes;
+    pt += step * (midEnd - midStart);
+
+    if (remainder >0)
+	{
+	UBYTE partial = *packed;
+	for (i=0; i<remainder; ++i, pt += step)
+	    *pt = table[((partial >> (6-i-i)) & 3) ^ comp];
+	}
+    }
+}
+
+struct blockRun
+/* Walks the blocks of N's or the masked blocks along a fragment. */
+    {
+    int blockCount;		/* Number of blocks. */
+    const bits32 *starts;	/* Starts of blocks. */
+    const bits32 *sizes;	/* Sizes of blocks. */
+    int ix;			/* Current block. */
+    };
+
+static void overlayBlocks(struct blockRun *run, int start, int end,
+	boolean isMask, DNA nLetter, boolean isRc, DNA *dna)
+/* Fill in the parts of dna, which holds bases start to end (reverse
+ * complemented if isRc is set), that are in blocks of run with nLetter, or
+ * lower case them if isMask is set.  Leave run on the first block that
+ * doesn't end before end. */
+{
+while (run->ix < run->blockCount)
+    {
+    int s = run->starts[run->ix];
+    int e = s + run->sizes[run->ix];
+    if (s >= end)
+	break;
+    boolean goesOn = (e > end);
+    if (s < start)
+	s = start;
+    if (goesOn)
+	e = end;
+    if (s < e)
+	{
+	DNA *pt = (isRc ? dna + end - e : dna + s - start);
+	int i;
+	if (isMask)
+	    {
+	    /* Letters and N's only differ from lower case by this bit. */
+	    for (i=0; i<e-s; ++i)
+		pt[i] |= 0x20;
+	    }
+	else
+	    memset(pt, nLetter, e - s);
+	}
+    if (goesOn)
+	break;	/* Rest of block is in next chunk. */
+    run->ix += 1;
+    }
+}
+
+#define decodeChunkSize (16*1024)
+/* Bases decoded at once by decodeFrag(), few enough to stay in the L1 cache
+ * while the blocks get applied. */
+
+static void decodeFrag(struct twoBitIOStats *stats, const UBYTE *packed,
+	int fragStart, int fragEnd, struct blockRun *nRun, struct blockRun *maskRun,
+	boolean doMask, boolean isRc, DNA *dna)
+/* Decode bases fragStart to fragEnd into dna, given the packed bytes starting
+ * with the one that holds base fragStart, and apply the blocks of N's and,
+ * if doMask is set, the masked blocks.  Done a chunk at a time in a single
+ * sweep: the bases are unpacked straight to upper case (or lower case if
+ * doMask is not set) and the blocks are applied while the chunk is still
+ * in cache, so dna only goes out to memory once.  If isRc is set dna gets
+ * the reverse complement, so the chunks fill it from the end.  The fragment
+ * is counted in stats unless it is NULL. */
+{
+int chunkStart, chunkEnd;
+bits64 startNanos = 0;
+if (stats != NULL && stats->timeDecode)
+    startNanos = monotonicNanos();
+for (chunkStart = fragStart; chunkStart < fragEnd; chunkStart = chunkEnd)
+    {
+    DNA *chunk;
+    chunkEnd = min(chunkStart + decodeChunkSize, fragEnd);
+    chunk = (isRc ? dna + fragEnd - chunkEnd : dna + chunkStart - fragStart);
+    unpackFrag(packed + (chunkStart>>2) - (fragStart>>2), chunkStart, chunkEnd,
+	    doMask, isRc, chunk);
+    overlayBlocks(nRun, chunkStart, chunkEnd, FALSE, (doMask ? 'N' : 'n'), isRc, chunk);
+    if (doMask)
+	overlayBlocks(maskRun, chunkStart, chunkEnd, TRUE, 0, isRc, chunk);
+    }
+if (stats != NULL)
+    {
+    stats->fragCount += 1;
+    stats->basesDecoded += fragEnd - fragStart;
+    if (stats->timeDecode)
+	stats->decodeNanos += monotonicNanos() - startNanos;
+    }
+}
+
+static void decodeCachedFrag(struct twoBitIOStats *stats,
+	const struct twoBitCachedHeader *cached, const UBYTE *packed,
+	int fragStart, int fragEnd, boolean doMask, boolean isRc, DNA *dna)
+/* Like decodeFrag() with the blocks of a cached header, found through its
+ * block indexes. */
+{
+const struct twoBitBlockIndex *nIndex = &cached->nIndex, *maskIndex = &cached->maskIndex;
+struct blockRun nRun = {nIndex->blockCount, nIndex->starts, nIndex->sizes,
+			blockIndexFind(nIndex, fragStart)};
+struct blockRun maskRun = {maskIndex->blockCount, maskIndex->starts, maskIndex->sizes,
+			   (doMask ? blockIndexFind(maskIndex, fragStart) : 0)};
+decodeFrag(stats, packed, fragStart, fragEnd, &nRun, &maskRun, doMask, isRc, dna);
+}
+
+void twoBitPackedViewUnpack(const struct twoBitPackedView *view,
+	int fragStart, int fragEnd, boolean doMask, boolean isRc, char *dna)
+/* Unpack bases fragStart to fragEnd of the sequence, which must be within
+ * view, into dna, or their reverse complement if isRc is set.  Blocks of N's
+ * and masking are applied as with twoBitReadSeqFragExt().  No zero is added
+ * at the end of dna. */
+{
+struct blockRun nRun = {view->nBlockCount, view->nStarts, view->nSizes, 0};
+struct blockRun maskRun = {view->maskBlockCount, view->maskStarts, view->maskSizes, 0};
+assert(fragStart >= view->start && fragEnd <= view->end);
+if (fragEnd <= fragStart)
+    return;
+if (nRun.blockCount > 0)
+    nRun.ix = findGreatestLowerBound(nRun.blockCount, nRun.starts, fragStart);
+if (doMask && maskRun.blockCount > 0)
+    maskRun.ix = findGreatestLowerBound(maskRun.blockCount, maskRun.starts, fragStart);
+decodeFrag(view->stats, view->packed + (fragStart>>2) - (view->start>>2),
+	fragStart, fragEnd, &nRun, &maskRun, doMask, isRc, dna);
+}
+
+static struct twoBitCachedHeader *getFragSeqHeader(struct twoBitFile *tbf, char *name,
+	int fragStart, int *pFragEnd)
+/* Get the sequence header information, which is cached, and validate
+ * fragment range, expanding an end of 0 to the sequence size. */
+{
+dnaUtilOpen();
+struct twoBitCachedHeader *cached = getTwoBitSeqHeader(tbf, name);
+struct twoBit *twoBit = cached->twoBit;
+if (*pFragEnd == 0)
+    *pFragEnd = twoBit->size;
+if (*pFragEnd > twoBit->size)
+    errAbort("twoBitReadSeqFrag in %s end (%d) >= seqSize (%d)", name, *pFragEnd, twoBit->size);
+if (*pFragEnd - fragStart < 1)
+    errAbort("twoBitReadSeqFrag in %s start (%d) >= end (%d)", name, fragStart, *pFragEnd);
+return cached;
+}
+
+static void readFragInto(struct twoBitFile *tbf, const struct twoBitCachedHeader *cached,
+	int fragStart, int fragEnd, boolean doMask, boolean isRc, DNA *dna)
+/* Decode bases fragStart to fragEnd of the sequence whose header was just
+ * fetched with getTwoBitSeqHeader() into dna, reverse complemented if isRc
+ * is set. */
+{
+int packedStart = (fragStart>>2);
+int packedEnd = ((fragEnd+3)>>2);
+UBYTE *packed, *packedAlloc;
+
+packed = readPackedBytes(tbf, packedStart, packedEnd - packedStart, &packedAlloc);
+decodeCachedFrag(&tbf->stats, cached, packed, fragStart, fragEnd, doMask, isRc, dna);
+freez(&packedAlloc);
+}
+
+struct dnaSeq *twoBitReadSeqFragExt(struct twoBitFile *tbf, char *name,
+	int fragStart, int fragEnd, boolean doMask, int *retFullSize)
+/* Read part of sequence from .2bit file.  To read full
+ * sequence call with start=end=0.  Sequence will be lower
+ * case if doMask is false, mixed case (repeats in lower)
+ * if doMask is true. */
+{
+struct dnaSeq *seq;
+int outSize;
+
+struct twoBitCachedHeader *cached = getFragSeqHeader(tbf, name, fragStart, &fragEnd);
+struct twoBit *twoBit = cached->twoBit;
+outSize = fragEnd - fragStart;
+
+/* Allocate dnaSeq, and fill in zero tag at end of sequence. */
+AllocVar(seq);
+if (outSize == twoBit->size)
+    seq->name = cloneString(name);
+else
+    {
+    char buf[256*2];
+    safef(buf, sizeof(buf), "%s:%d-%d", name, fragStart, fragEnd);
+    seq->name = cloneString(buf);
+    }
+seq->size = outSize;
+seq->dna = needLargeMem(outSize+1);
+seq->dna[outSize] = 0;
+
+readFragInto(tbf, cached, fragStart, fragEnd, doMask, FALSE, seq->dna);
+if (retFullSize != NULL)
+    *retFullSize = twoBit->size;
+return seq;
+}
 
-/* Read in seqSize. */
-twoBit->size = (*tbf->ourReadBits32)(f, isSwapped);
+int twoBitReadSeqFragInto(struct twoBitFile *tbf, char *name,
+	int fragStart, int fragEnd, boolean doMask, boolean isRc, DNA *dna)
+/* Like twoBitReadSeqFragExt() but decode the bases into dna, which must have
+ * room for fragEnd-fragStart bases (the full sequence if fragEnd is 0), and
+ * return the number of bases written.  If isRc is set dna gets the reverse
+ * complement of the fragment (masking is kept), decoded straight from the
+ * packed bytes.  No zero is added at the end of dna.  Once the sequence
+ * header is cached this doesn't allocate any memory for fragments of up to
+ * 4*TWOBIT_SCRATCH_MAX bases. */
+{
+struct twoBitCachedHeader *cached = getFragSeqHeader(tbf, name, fragStart, &fragEnd);
+readFragInto(tbf, cached, fragStart, fragEnd, doMask, isRc, dna);
+return fragEnd - fragStart;
+}
 
-/* Read in blocks of N. */
-readBlockCoords(tbf, isSwapped, &(twoBit->nBlockCount),
-		&(twoBit->nStarts), &(twoBit->nSizes));
+void twoBitCountBlockBases(struct twoBitFile *tbf, char *name,
+	int fragStart, int fragEnd, int *retNCount, int *retMaskCount)
+/* Put the number of bases from fragStart to fragEnd of the sequence that
+ * are in blocks of N's in *retNCount, and the number of them that are in
+ * masked blocks in *retMaskCount, without reading the sequence data.  For
+ * the full sequence call with start=end=0.  N's can be masked too. */
+{
+struct twoBitCachedHeader *cached = getFragSeqHeader(tbf, name, fragStart, &fragEnd);
+*retNCount = blockIndexCount(&cached->nIndex, fragStart, fragEnd);
+*retMaskCount = blockIndexCount(&cached->maskIndex, fragStart, fragEnd);
+}
 
-/* Read in masked blocks. */
-readBlockCoords(tbf, isSwapped, &(twoBit->maskBlockCount),
-		&(twoBit->maskStarts), &(twoBit->maskSizes));
+struct dnaSeq *twoBitReadSeqFrag(struct twoBitFile *tbf, char *name,
+	int fragStart, int fragEnd)
+/* Read part of sequence from .2bit file.  To read full
+ * sequence call with start=end=0.  Note that sequence will
+ * be mixed case, with repeats in lower case and rest in
+ * upper case. */
+{
+return twoBitReadSeqFragExt(tbf, name, fragStart, fragEnd, TRUE, NULL);
+}
 
-/* Reserved word. */
-twoBit->reserved = (*tbf->ourReadBits32)(f, isSwapped);
+struct dnaSeq *twoBitReadSeqFragLower(struct twoBitFile *tbf, char *name,
+	int fragStart, int fragEnd)
+/* Same as twoBitReadSeqFrag, but sequence is returned in lower case. */
+{
+return twoBitReadSeqFragExt(tbf, name, fragStart, fragEnd, FALSE, NULL);
+}
 
-return twoBit;
+struct twoBitReader *twoBitReaderNew(struct twoBitFile *tbf)
+/* Return a new reader on tbf.  Readers give a reentrant read path: each
+ * thread creates its own reader on the shared tbf (from the main thread,
+ * as this may abort) and then reads through it without touching the file
+ * position or header cache of tbf.  The twoBitReader* functions never
+ * abort, they report errors in reader->errMsg instead.  Free readers with
+ * twoBitReaderFree() before closing tbf.  The reader times decoding if
+ * tbf->stats.timeDecode is set when it is created. */
+{
+struct twoBitReader *reader;
+dnaUtilOpen();
+AllocVar(reader);
+reader->tbf = tbf;
+reader->headerCache.maxCount = tbf->headerCache.maxCount;
+reader->headerCache.maxBytes = tbf->headerCache.maxBytes;
+reader->stats.timeDecode = tbf->stats.timeDecode;
+if (tbf->ourReadAt == NULL)
+    {
+    /* No positional reads on this platform, use a private file handle. */
+    reader->f = mustOpen(tbf->fileName, "rb");
+    }
+return reader;
 }
 
-struct twoBit *twoBitOneFromFile(struct twoBitFile *tbf, char *name)
-/* Get single sequence as two bit. */
+void twoBitReaderFree(struct twoBitReader **pReader)
+/* Free up reader, adding its stats to those of its tbf. */
 {
-struct twoBit *twoBit = readTwoBitSeqHeader(tbf, name);
-bits32 packByteCount;
-void *f = tbf->f;
+struct twoBitReader *reader = *pReader;
+if (reader != NULL)
+    {
+    twoBitIOStatsAdd(&reader->tbf->stats, &reader->stats);
+    headerCacheFree(&reader->headerCache);
+    free(reader->scratch);
+    if (reader->f != NULL)
+	fclose(reader->f);
+    freez(pReader);
+    }
+}
 
-/* Read in data. */
-packByteCount = packedSize(twoBit->size);
-twoBit->data = needLargeMem(packByteCount);
-(*tbf->ourMustRead)(f, twoBit->data, packByteCount);
+static boolean readerReadAt(struct twoBitReader *reader, bits64 offset, void *buf, size_t size)
+/* Read size bytes at offset without touching the shared file position. */
+{
+struct twoBitFile *tbf = reader->tbf;
+boolean ok;
+reader->stats.readCount += 1;
+reader->stats.bytesRead += size;
+if (reader->f != NULL)
+    {
+    reader->stats.seekCount += 1;
+    ok = fseek(reader->f, offset, SEEK_SET) == 0 && fread(buf, size, 1, reader->f) == 1;
+    }
+else
+    ok = (*tbf->ourReadAt)(tbf->f, offset, buf, size);
+if (!ok)
+    snprintf(reader->errMsg, sizeof(reader->errMsg), "error reading %lld bytes from %s",
+	(long long)size, tbf->fileName);
+return ok;
+}
 
-return twoBit;
+static boolean readerReadBits32(struct twoBitReader *reader, bits64 *pOffset, bits32 *retVal)
+/* Read 32 bit entity at *pOffset and advance *pOffset past it. */
+{
+bits32 val;
+if (!readerReadAt(reader, *pOffset, &val, sizeof(val)))
+    return FALSE;
+*pOffset += sizeof(val);
+*retVal = reader->tbf->isSwapped ? byteSwap32(val) : val;
+return TRUE;
 }
 
-struct twoBit *twoBitFromOpenFile(struct twoBitFile *tbf)
-/* Get twoBit list of all sequences in twoBit file. */
+static boolean readerBlockCoords(struct twoBitReader *reader, bits64 *pOffset,
+	bits32 *retBlockCount, bits32 **retBlockStarts, bits32 **retBlockSizes)
+/* Like readBlockCoords() but for a reader. */
 {
-struct twoBitIndex *index;
-struct twoBit *twoBitList = NULL;
+bits32 blkCount, i;
+bits32 *starts, *sizes;
+size_t arraySize;
 
-for (index = tbf->indexList; index != NULL; index = index->next)
+if (!readerReadBits32(reader, pOffset, &blkCount))
+    return FALSE;
+*retBlockCount = blkCount;
+if (blkCount == 0)
+    return TRUE;
+arraySize = sizeof(starts[0]) * blkCount;
+*retBlockStarts = starts = malloc(arraySize);
+*retBlockSizes = sizes = malloc(arraySize);
+if (starts == NULL || sizes == NULL)
     {
-    struct twoBit *twoBit = twoBitOneFromFile(tbf, index->name);
-    slAddHead(&twoBitList, twoBit);
+    snprintf(reader->errMsg, sizeof(reader->errMsg), "out of memory");
+    return FALSE;
     }
-
-twoBitClose(&tbf);
-slReverse(&twoBitList);
-return twoBitList;
+if (!readerReadAt(reader, *pOffset, starts, arraySize)
+ || !readerReadAt(reader, *pOffset + arraySize, sizes, arraySize))
+    return FALSE;
+*pOffset += 2 * arraySize;
+if (reader->tbf->isSwapped)
+    {
+    for (i=0; i<blkCount; ++i)
+	{
+	starts[i] = byteSwap32(starts[i]);
+	sizes[i] = byteSwap32(sizes[i]);
+	}
+    }
+return TRUE;
 }
 
-struct twoBit *twoBitFromFile(const char *fileName)
-/* Get twoBit list of all sequences in already open twoBit file. */
+static struct twoBitCachedHeader *readerReadHeader(struct twoBitReader *reader, char *name)
+/* Read header of named sequence and add it to the header cache of reader.
+ * Returns NULL on error. */
 {
-struct twoBitFile *tbf = twoBitOpen(fileName);
+struct twoBitCachedHeader *cached;
+struct twoBit *twoBit;
+struct twoBitIndex *index;
+bits64 offset;
 
-return twoBitFromOpenFile(tbf);
+index = hashFindVal(reader->tbf->hash, name);
+if (index == NULL)
+    {
+    snprintf(reader->errMsg, sizeof(reader->errMsg), "%s is not in %s",
+	name, reader->tbf->fileName);
+    return NULL;
+    }
+twoBit = calloc(1, sizeof(*twoBit));
+if (twoBit == NULL)
+    {
+    snprintf(reader->errMsg, sizeof(reader->errMsg), "out of memory");
+    return NULL;
+    }
+twoBit->name = index->name;	/* Allocated in hash of tbf. */
+offset = index->offset;
+if (!readerReadBits32(reader, &offset, &twoBit->size)
+ || !readerBlockCoords(reader, &offset, &twoBit->nBlockCount,
+			&twoBit->nStarts, &twoBit->nSizes)
+ || !readerBlockCoords(reader, &offset, &twoBit->maskBlockCount,
+			&twoBit->maskStarts, &twoBit->maskSizes)
+ || !readerReadBits32(reader, &offset, &twoBit->reserved))
+    {
+    twoBitFree(&twoBit);
+    return NULL;
+    }
+cached = headerCacheAdd(&reader->headerCache, twoBit, offset);
+if (cached == NULL)
+    snprintf(reader->errMsg, sizeof(reader->errMsg), "out of memory");
+return cached;
 }
 
-
-void twoBitFree(struct twoBit **pTwoBit)
-/* Free up a two bit structure. */
+static struct twoBitCachedHeader *readerSeqHeader(struct twoBitReader *reader, char *name)
+/* Like getTwoBitSeqHeader() but for a reader.  Returns NULL on error. */
 {
-struct twoBit *twoBit = *pTwoBit;
-if (twoBit != NULL)
+struct twoBitCachedHeader *cached = headerCacheFind(&reader->headerCache, name);
+if (cached != NULL)
+    reader->stats.headerHits += 1;
+else
     {
-    freeMem(twoBit->nStarts);
-    freeMem(twoBit->nSizes);
-    freeMem(twoBit->maskStarts);
-    freeMem(twoBit->maskSizes);
-    freeMem(twoBit->data);
-    freez(pTwoBit);
+    reader->stats.headerMisses += 1;
+    cached = readerReadHeader(reader, name);
+    if (cached == NULL)
+	return NULL;
     }
+reader->seqCache = cached->twoBit;
+reader->dataOffsetCache = cached->dataOffset;
+return cached;
 }
 
-void twoBitFreeList(struct twoBit **pList)
-/* Free a list of dynamically allocated twoBit's */
+static boolean readerCheckRange(struct twoBitReader *reader, struct twoBit *twoBit,
+	int fragStart, int *pFragEnd)
+/* Validate fragment range, expanding an end of 0 to the sequence size. */
 {
-struct twoBit *el, *next;
-
-for (el = *pList; el != NULL; el = next)
+if (*pFragEnd == 0)
+    *pFragEnd = twoBit->size;
+if (*pFragEnd > twoBit->size)
     {
-    next = el->next;
-    twoBitFree(&el);
+    snprintf(reader->errMsg, sizeof(reader->errMsg), "%s end (%d) >= seqSize (%d)",
+	twoBit->name, *pFragEnd, twoBit->size);
+    return FALSE;
     }
-*pList = NULL;
+if (fragStart < 0 || *pFragEnd - fragStart < 1)
+    {
+    snprintf(reader->errMsg, sizeof(reader->errMsg), "%s start (%d) >= end (%d)",
+	twoBit->name, fragStart, *pFragEnd);
+    return FALSE;
+    }
+return TRUE;
 }
 
-static struct twoBit *getTwoBitSeqHeader(struct twoBitFile *tbf, char *name)
-/* get the sequence header information using the cache.  Position file
- * right at data. */
+static const UBYTE *readerPackedBytes(struct twoBitReader *reader, int packedStart,
+	int packByteCount, UBYTE **retAlloc)
+/* Like readPackedBytes() but for a reader.  Returns NULL on error. */
 {
-if ((tbf->seqCache != NULL) && (sameString(tbf->seqCache->name, name)))
+struct twoBitFile *tbf = reader->tbf;
+bits64 offset = reader->dataOffsetCache + packedStart;
+UBYTE *packed;
+*retAlloc = NULL;
+if (tbf->ourMapAt != NULL)
     {
-    // use cached
-    (*tbf->ourSeek)(tbf->f, tbf->dataOffsetCache);
+    packed = tbfMapAt(tbf, &reader->stats, offset, packByteCount);
+    if (packed == NULL)
+	snprintf(reader->errMsg, sizeof(reader->errMsg), "%s is truncated", tbf->fileName);
+    return packed;
     }
-else
+packed = packedBuffer(&reader->scratch, &reader->scratchSize, packByteCount, retAlloc);
+if (packed == NULL)
     {
-    // fetch new and cache
-    twoBitFree(&tbf->seqCache);
-    tbf->seqCache = readTwoBitSeqHeader(tbf, name);
-    tbf->dataOffsetCache = (*tbf->ourTell)(tbf->f);
+    snprintf(reader->errMsg, sizeof(reader->errMsg), "out of memory");
+    return NULL;
     }
-return tbf->seqCache;
+if (!readerReadAt(reader, offset, packed, packByteCount))
+    {
+    freez(retAlloc);
+    return NULL;
+    }
+return packed;
 }
 
-struct dnaSeq *twoBitReadSeqFragExt(struct twoBitFile *tbf, char *name,
+struct dnaSeq *twoBitReaderReadSeqFragExt(struct twoBitReader *reader, char *name,
 	int fragStart, int fragEnd, boolean doMask, int *retFullSize)
-/* Read part of sequence from .2bit file.  To read full
- * sequence call with start=end=0.  Sequence will be lower
- * case if doMask is false, mixed case (repeats in lower)
- * if doMask is true. */
+/* Like twoBitReadSeqFragExt() but through reader, so safe to call from several
+ * threads at once as long as each uses its own reader.  Returns NULL with
+ * reader->errMsg set on error.  Free result with dnaSeqFree(). */
 {
+struct twoBitCachedHeader *cached;
+struct twoBit *twoBit;
 struct dnaSeq *seq;
-void *f = tbf->f;
-int i;
-int packByteCount, packedStart, packedEnd, remainder, midStart, midEnd;
-int outSize;
-UBYTE *packed, *packedAlloc;
-DNA *dna;
-
-/* get sequence header information, which is cached */
-dnaUtilOpen();
-struct twoBit *twoBit = getTwoBitSeqHeader(tbf, name);
-
-/* validate range. */
-if (fragEnd == 0)
-    fragEnd = twoBit->size;
-if (fragEnd > twoBit->size)
-    errAbort("twoBitReadSeqFrag in %s end (%d) >= seqSize (%d)", name, fragEnd, twoBit->size);
+const UBYTE *packed;
+UBYTE *packedAlloc;
+int packedStart, outSize;
+char buf[256*2];
+
+if ((cached = readerSeqHeader(reader, name)) == NULL)
+    return NULL;
+twoBit = cached->twoBit;
+if (!readerCheckRange(reader, twoBit, fragStart, &fragEnd))
+    return NULL;
 outSize = fragEnd - fragStart;
-if (outSize < 1)
-    errAbort("twoBitReadSeqFrag in %s start (%d) >= end (%d)", name, fragStart, fragEnd);
+packedStart = (fragStart>>2);
+packed = readerPackedBytes(reader, packedStart, ((fragEnd+3)>>2) - packedStart,
+	&packedAlloc);
+if (packed == NULL)
+    return NULL;
 
-/* Allocate dnaSeq, and fill in zero tag at end of sequence. */
-AllocVar(seq);
 if (outSize == twoBit->size)
-    seq->name = cloneString(name);
+    snprintf(buf, sizeof(buf), "%s", name);
 else
+    snprintf(buf, sizeof(buf), "%s:%d-%d", name, fragStart, fragEnd);
+seq = calloc(1, sizeof(*seq));
+if (seq == NULL || (seq->name = malloc(strlen(buf)+1)) == NULL
+ || (seq->dna = malloc(outSize+1)) == NULL)
     {
-    char buf[256*2];
-    safef(buf, sizeof(buf), "%s:%d-%d", name, fragStart, fragEnd);
-    seq->name = cloneString(buf);
+    free(packedAlloc);
+    dnaSeqFree(&seq);
+    snprintf(reader->errMsg, sizeof(reader->errMsg), "out of memory");
+    return NULL;
     }
+strcpy(seq->name, buf);
 seq->size = outSize;
-dna = seq->dna = needLargeMem(outSize+1);
 seq->dna[outSize] = 0;
 
+decodeCachedFrag(&reader->stats, cached, packed, fragStart, fragEnd, doMask, FALSE,
+	seq->dna);
+free(packedAlloc);
+if (retFullSize != NULL)
+    *retFullSize = twoBit->size;
+return seq;
+}
 
-/* Skip to bits we need and read them in. */
+int twoBitReaderReadSeqFragInto(struct twoBitReader *reader, char *name,
+	int fragStart, int fragEnd, boolean doMask, boolean isRc, DNA *dna)
+/* Like twoBitReadSeqFragInto() but through reader.  Returns -1 with
+ * reader->errMsg set on error. */
+{
+struct twoBitCachedHeader *cached;
+struct twoBit *twoBit;
+const UBYTE *packed;
+UBYTE *packedAlloc;
+int packedStart;
+
+if ((cached = readerSeqHeader(reader, name)) == NULL)
+    return -1;
+twoBit = cached->twoBit;
+if (!readerCheckRange(reader, twoBit, fragStart, &fragEnd))
+    return -1;
 packedStart = (fragStart>>2);
-packedEnd = ((fragEnd+3)>>2);
-packByteCount = packedEnd - packedStart;
-packed = packedAlloc = needLargeMem(packByteCount);
-(*tbf->ourSeekCur)(f, packedStart);
-(*tbf->ourMustRead)(f, packed, packByteCount);
+packed = readerPackedBytes(reader, packedStart, ((fragEnd+3)>>2) - packedStart,
+	&packedAlloc);
+if (packed == NULL)
+    return -1;
+decodeCachedFrag(&reader->stats, cached, packed, fragStart, fragEnd, doMask, isRc, dna);
+free(packedAlloc);
+return fragEnd - fragStart;
+}
 
-/* Handle case where everything is in one packed byte */
-if (packByteCount == 1)
+boolean twoBitReaderCountBlockBases(struct twoBitReader *reader, char *name,
+	int fragStart, int fragEnd, int *retNCount, int *retMaskCount)
+/* Like twoBitCountBlockBases() but through reader.  Returns FALSE with
+ * reader->errMsg set on error. */
+{
+struct twoBitCachedHeader *cached;
+
+if ((cached = readerSeqHeader(reader, name)) == NULL)
+    return FALSE;
+if (!readerCheckRange(reader, cached->twoBit, fragStart, &fragEnd))
+    return FALSE;
+*retNCount = blockIndexCount(&cached->nIndex, fragStart, fragEnd);
+*retMaskCount = blockIndexCount(&cached->maskIndex, fragStart, fragEnd);
+return TRUE;
+}
+
+boolean twoBitReaderReadPackedView(struct twoBitReader *reader, char *name,
+	int fragStart, int fragEnd, struct twoBitPackedView *view)
+/* Like twoBitReadPackedView() but through reader.  The view is good until
+ * the next read through reader.  Returns FALSE with reader->errMsg set on
+ * error. */
+{
+struct twoBitCachedHeader *cached;
+struct twoBit *twoBit;
+int packedStart;
+
+if ((cached = readerSeqHeader(reader, name)) == NULL)
+    return FALSE;
+twoBit = cached->twoBit;
+if (!readerCheckRange(reader, twoBit, fragStart, &fragEnd))
+    return FALSE;
+ZeroVar(view);
+view->start = fragStart;
+view->end = fragEnd;
+view->seqSize = twoBit->size;
+packedStart = (fragStart>>2);
+view->packed = readerPackedBytes(reader, packedStart, ((fragEnd+3)>>2) - packedStart,
+	&view->packedAlloc);
+if (view->packed == NULL)
+    return FALSE;
+view->bitOffset = (fragStart&3) << 1;
+view->stats = &reader->stats;
+fillViewBlocks(cached, view);
+return TRUE;
+}
+
+static bits64 indexChecksum(struct twoBitFile *tbf)
+/* Return FNV-1a hash of names and offsets in index of tbf.  Stored in
+ * summary file to tell whether it is still up to date. */
+{
+bits64 sum = 0xcbf29ce484222325ULL;
+struct twoBitIndex *index;
+for (index = tbf->indexList; index != NULL; index = index->next)
     {
-    int pOff = (packedStart<<2);
-    int pStart = fragStart - pOff;
-    int pEnd = fragEnd - pOff;
-    UBYTE partial = *packed;
-    assert(pEnd <= 4);
-    assert(pStart >= 0);
-    for (i=pStart; i<pEnd; ++i)
-	*dna++ = valToNt[(partial >> (6-i-i)) & 3];
+    char *s = index->name;
+    int i;
+    do
+	sum = (sum ^ (UBYTE)*s) * 0x100000001b3ULL;
+    while (*s++ != 0);
+    for (i=0; i<8; ++i)
+	sum = (sum ^ ((index->offset >> (8*i)) & 0xff)) * 0x100000001b3ULL;
     }
-else
-    {
-    /* Handle partial first packed byte. */
-    midStart = fragStart;
-    remainder = (fragStart&3);
-    if (remainder > 0)
-	{
-	UBYTE partial = *packed++;
-	int partCount = 4 - remainder;
-	for (i=partCount-1; i>=0; --i)
-	    {
-	    dna[i] = valToNt[partial&3];
-	    partial >>= 2;
-	    }
-	midStart += partCount;
-	dna += partCount;
-	}
+return sum;
+}
 
-    /* Handle middle bytes. */
-    remainder = fragEnd&3;
-    midEnd = fragEnd - remainder;
-    for (i=midStart; i<midEnd; i += 4)
-        {
-	UBYTE b = *packed++;
-	dna[3] = valToNt[b&3];
-	b >>= 2;
-	dna[2] = valToNt[b&3];
-	b >>= 2;
-	dna[1] = valToNt[b&3];
-	b >>= 2;
-	dna[0] = valToNt[b&3];
-	dna += 4;
-	}
+char *twoBitSummaryFileName(const char *twoBitName)
+/* Return name of summary file of twoBitName.  FreeMem result when done. */
+{
+char *fileName = needMem(strlen(twoBitName) + strlen(TWOBIT_SUMMARY_SUFFIX) + 1);
+strcpy(fileName, twoBitName);
+strcat(fileName, TWOBIT_SUMMARY_SUFFIX);
+return fileName;
+}
 
-    if (remainder >0)
-	{
-	UBYTE part = *packed;
-	part >>= (8-remainder-remainder);
-	for (i=remainder-1; i>=0; --i)
-	    {
-	    dna[i] = valToNt[part&3];
-	    part >>= 2;
-	    }
-	}
-    }
-freez(&packedAlloc);
+/* A summary file is a header of this size followed by a struct
+ * twoBitSeqSummary per sequence:
+ *    bits32 signature, version, seqCount, reserved
+ *    bits64 size of 2bit file in bytes, indexChecksum() of 2bit file
+ *    bits64 modification time of 2bit file in seconds, and nanoseconds */
+#define summaryHeaderSize 48
+#define summaryVersion 1
+
+static void statMtime(struct stat *st, bits64 *retSec, bits64 *retNsec)
+/* Return modification time of st, with nanoseconds where the system has
+ * them (zero otherwise). */
+{
+*retSec = st->st_mtime;
+#if defined(__APPLE__)
+*retNsec = st->st_mtimespec.tv_nsec;
+#elif defined(_WIN32)
+*retNsec = 0;
+#else
+*retNsec = st->st_mtim.tv_nsec;
+#endif
+}
 
-if (twoBit->nBlockCount > 0)
+struct twoBitSeqSummary *twoBitSummaryRead(struct twoBitFile *tbf,
+	const char *fileName)
+/* Read summary file of tbf.  Return NULL if there is no such file, or if it
+ * doesn't look like it was made from the current version of tbf.  The
+ * result has an element per sequence of tbf, in file order.  FreeMem result
+ * when done.  TwoBitOpen() calls this on twoBitSummaryFileName(), so files
+ * with an up to date summary file get their tbf->summary automatically. */
+{
+struct stat st, twoBitSt;
+struct twoBitSeqSummary *summary;
+bits32 sig, version, seqCount;
+bits64 twoBitSize, checksum, mtimeSec, mtimeNsec, twoBitSec, twoBitNsec;
+size_t fileSize = summaryHeaderSize +
+	(size_t)tbf->seqCount * sizeof(struct twoBitSeqSummary);
+boolean isSwapped;
+UBYTE *buf;
+FILE *f;
+int i;
+
+/* Summary file must be there and of the expected size.  Then it is read in a
+ * single read. */
+if (tbf->seqCount == 0 || stat(fileName, &st) < 0 || st.st_size != fileSize
+ || stat(tbf->fileName, &twoBitSt) < 0)
+    return NULL;
+statMtime(&twoBitSt, &twoBitSec, &twoBitNsec);
+f = fopen(fileName, "rb");
+if (f == NULL)
+    return NULL;
+buf = needLargeMem(fileSize);
+if (fread(buf, 1, fileSize, f) != fileSize)
     {
-    int startIx = findGreatestLowerBound(twoBit->nBlockCount, twoBit->nStarts, fragStart);
-    for (i=startIx; i<twoBit->nBlockCount; ++i)
-        {
-	int s = twoBit->nStarts[i];
-	int e = s + twoBit->nSizes[i];
-	if (s >= fragEnd)
-	    break;
-	if (s < fragStart)
-	   s = fragStart;
-	if (e > fragEnd)
-	   e = fragEnd;
-	if (s < e)
-	    memset(seq->dna + s - fragStart, 'n', e - s);
-	}
+    fclose(f);
+    freeMem(buf);
+    return NULL;
+    }
+fclose(f);
+
+memcpy(&sig, buf, sizeof(sig));
+isSwapped = (sig == twoBitSummarySwapSig);
+memcpy(&version, buf + 4, sizeof(version));
+memcpy(&seqCount, buf + 8, sizeof(seqCount));
+memcpy(&twoBitSize, buf + 16, sizeof(twoBitSize));
+memcpy(&checksum, buf + 24, sizeof(checksum));
+memcpy(&mtimeSec, buf + 32, sizeof(mtimeSec));
+memcpy(&mtimeNsec, buf + 40, sizeof(mtimeNsec));
+if (isSwapped)
+    {
+    version = byteSwap32(version);
+    seqCount = byteSwap32(seqCount);
+    twoBitSize = byteSwap64(twoBitSize);
+    checksum = byteSwap64(checksum);
+    mtimeSec = byteSwap64(mtimeSec);
+    mtimeNsec = byteSwap64(mtimeNsec);
+    }
+/* The 2bit file must have the exact size and modification time it had when
+ * the summary was written: a 2bit file rewritten with the same names, sizes
+ * and offsets (so the same index checksum) but different blocks of N's or
+ * masked blocks is otherwise taken for the old one. */
+if ((sig != twoBitSummarySig && !isSwapped) || version != summaryVersion
+ || seqCount != tbf->seqCount || twoBitSize != twoBitSt.st_size
+ || mtimeSec != twoBitSec || mtimeNsec != twoBitNsec
+ || checksum != indexChecksum(tbf))
+    {
+    freeMem(buf);
+    return NULL;
     }
 
-if (doMask)
+/* Move the records to the start of the buffer. */
+summary = (struct twoBitSeqSummary *)buf;
+memmove(summary, buf + summaryHeaderSize, fileSize - summaryHeaderSize);
+if (isSwapped)
     {
-    toUpperN(seq->dna, seq->size);
-    if (twoBit->maskBlockCount > 0)
+    for (i=0; i<seqCount; ++i)
 	{
-	int startIx = findGreatestLowerBound(twoBit->maskBlockCount, twoBit->maskStarts,
-		fragStart);
-	for (i=startIx; i<twoBit->maskBlockCount; ++i)
-	    {
-	    int s = twoBit->maskStarts[i];
-	    int e = s + twoBit->maskSizes[i];
-	    if (s >= fragEnd)
-		break;
-	    if (s < fragStart)
-		s = fragStart;
-	    if (e > fragEnd)
-		e = fragEnd;
-	    if (s < e)
-		toLowerN(seq->dna + s - fragStart, e - s);
-	    }
+	struct twoBitSeqSummary *sum = summary + i;
+	sum->size = byteSwap32(sum->size);
+	sum->nBlockCount = byteSwap32(sum->nBlockCount);
+	sum->nBaseCount = byteSwap32(sum->nBaseCount);
+	sum->maskBlockCount = byteSwap32(sum->maskBlockCount);
+	sum->maskBaseCount = byteSwap32(sum->maskBaseCount);
+	sum->reserved = byteSwap32(sum->reserved);
+	sum->dataOffset = byteSwap64(sum->dataOffset);
 	}
     }
-if (retFullSize != NULL)
-    *retFullSize = twoBit->size;
-return seq;
+return summary;
 }
 
-struct dnaSeq *twoBitReadSeqFrag(struct twoBitFile *tbf, char *name,
-	int fragStart, int fragEnd)
-/* Read part of sequence from .2bit file.  To read full
- * sequence call with start=end=0.  Note that sequence will
- * be mixed case, with repeats in lower case and rest in
- * upper case. */
+static bits32 blockBaseCount(bits32 blockCount, bits32 *sizes)
+/* Return total size of blocks. */
 {
-return twoBitReadSeqFragExt(tbf, name, fragStart, fragEnd, TRUE, NULL);
+bits32 i, total = 0;
+for (i=0; i<blockCount; ++i)
+    total += sizes[i];
+return total;
 }
 
-struct dnaSeq *twoBitReadSeqFragLower(struct twoBitFile *tbf, char *name,
-	int fragStart, int fragEnd)
-/* Same as twoBitReadSeqFrag, but sequence is returned in lower case. */
+void twoBitSummaryWrite(struct twoBitFile *tbf, const char *fileName)
+/* Read all sequence headers of tbf and write their summary to fileName.
+ * Also attach the summary to tbf. */
 {
-return twoBitReadSeqFragExt(tbf, name, fragStart, fragEnd, FALSE, NULL);
+struct twoBitSeqSummary *summary = NULL;
+struct twoBitIndex *index;
+struct stat st;
+bits32 sig = twoBitSummarySig, version = summaryVersion, seqCount = tbf->seqCount;
+bits32 reserved = 0;
+bits64 twoBitSize, checksum = indexChecksum(tbf), mtimeSec, mtimeNsec;
+char *tmpName;
+FILE *f;
+int i;
+
+if (stat(tbf->fileName, &st) < 0)
+    errnoAbort("stat() failed on %s", tbf->fileName);
+twoBitSize = st.st_size;
+statMtime(&st, &mtimeSec, &mtimeNsec);
+if (seqCount > 0)
+    AllocArray(summary, seqCount);
+for (i=0, index = tbf->indexList; index != NULL; ++i, index = index->next)
+    {
+    struct twoBit *twoBit = readTwoBitSeqHeader(tbf, index->name);
+    struct twoBitSeqSummary *sum = summary + i;
+    sum->size = twoBit->size;
+    sum->nBlockCount = twoBit->nBlockCount;
+    sum->nBaseCount = blockBaseCount(twoBit->nBlockCount, twoBit->nSizes);
+    sum->maskBlockCount = twoBit->maskBlockCount;
+    sum->maskBaseCount = blockBaseCount(twoBit->maskBlockCount, twoBit->maskSizes);
+    sum->dataOffset = (*tbf->ourTell)(tbf->f);
+    freeMem(twoBit->name);
+    twoBitFree(&twoBit);
+    }
+
+/* Write to a temporary file renamed when complete, so that a reader never
+ * sees a partial summary file. */
+tmpName = needMem(strlen(fileName) + 5);
+strcpy(tmpName, fileName);
+strcat(tmpName, ".tmp");
+f = mustOpen(tmpName, "wb");
+writeOne(f, sig);
+writeOne(f, version);
+writeOne(f, seqCount);
+writeOne(f, reserved);
+writeOne(f, twoBitSize);
+writeOne(f, checksum);
+writeOne(f, mtimeSec);
+writeOne(f, mtimeNsec);
+if (seqCount > 0)
+    mustWrite(f, summary, sizeof(summary[0]) * seqCount);
+carefulClose(&f);
+if (rename(tmpName, fileName) < 0)
+    errnoAbort("Couldn't rename %s to %s", tmpName, fileName);
+freeMem(tmpName);
+
+freeMem(tbf->summary);
+tbf->summary = summary;
+}
+
+static struct twoBitSeqSummary *findSeqSummary(struct twoBitFile *tbf, char *name)
+/* Return summary of named sequence, or NULL if tbf has no summary.  Abort if
+ * sequence is not in tbf. */
+{
+struct twoBitIndex *index;
+if (tbf->summary == NULL)
+    return NULL;
+index = hashFindVal(tbf->hash, name);
+if (index == NULL)
+    errAbort("%s is not in %s", name, tbf->fileName);
+return tbf->summary + (index - tbf->indexArray);
 }
 
 int twoBitSeqSize(struct twoBitFile *tbf, char *name)
 /* Return size of sequence in two bit file in bases. */
 {
+struct twoBitSeqSummary *sum = findSeqSummary(tbf, name);
+if (sum != NULL)
+    return sum->size;
 twoBitSeekTo(tbf, name);
-return (*tbf->ourReadBits32)(tbf->f, tbf->isSwapped);
+return tbfReadBits32(tbf, tbf->isSwapped);
 }
 
 long long twoBitTotalSize(struct twoBitFile *tbf)
@@ -875,10 +2941,17 @@ long long twoBitTotalSize(struct twoBitFile *tbf)
 {
 struct twoBitIndex *index;
 long long totalSize = 0;
+int i;
+if (tbf->summary != NULL)
+    {
+    for (i=0; i<tbf->seqCount; ++i)
+	totalSize += tbf->summary[i].size;
+    return totalSize;
+    }
 for (index = tbf->indexList; index != NULL; index = index->next)
     {
-    (*tbf->ourSeek)(tbf->f, index->offset);
-    totalSize += (*tbf->ourReadBits32)(tbf->f, tbf->isSwapped);
+    tbfSeek(tbf, index->offset);
+    totalSize += tbfReadBits32(tbf, tbf->isSwapped);
     }
 return totalSize;
 }
@@ -1186,10 +3259,10 @@ int nBlockCount;
 
 twoBitSeekTo(tbf, seqName);
 
-(*tbf->ourReadBits32)(tbf->f, tbf->isSwapped);
+tbfReadBits32(tbf, tbf->isSwapped);
 
 /* Read in blocks of N. */
-nBlockCount = (*tbf->ourReadBits32)(tbf->f, tbf->isSwapped);
+nBlockCount = tbfReadBits32(tbf, tbf->isSwapped);
 
 if (nBlockCount > 0)
     {
@@ -1198,8 +3271,8 @@ if (nBlockCount > 0)
 
     AllocArray(nStarts, nBlockCount);
     AllocArray(nSizes, nBlockCount);
-    (*tbf->ourMustRead)(tbf->f, nStarts, sizeof(nStarts[0]) * nBlockCount);
-    (*tbf->ourMustRead)(tbf->f, nSizes, sizeof(nSizes[0]) * nBlockCount);
+    tbfMustRead(tbf, nStarts, sizeof(nStarts[0]) * nBlockCount);
+    tbfMustRead(tbf, nSizes, sizeof(nSizes[0]) * nBlockCount);
     if (tbf->isSwapped)
 	{
 	for (i=0; i<nBlockCount; ++i)
@@ -1224,13 +3297,17 @@ int twoBitSeqSizeNoNs(struct twoBitFile *tbf, char *seqName)
 {
 int nBlockCount;
 int size;
+struct twoBitSeqSummary *sum = findSeqSummary(tbf, seqName);
+
+if (sum != NULL)
+    return sum->size - sum->nBaseCount;
 
 twoBitSeekTo(tbf, seqName);
 
-size = (*tbf->ourReadBits32)(tbf->f, tbf->isSwapped);
+size = tbfReadBits32(tbf, tbf->isSwapped);
 
 /* Read in blocks of N. */
-nBlockCount = (*tbf->ourReadBits32)(tbf->f, tbf->isSwapped);
+nBlockCount = tbfReadBits32(tbf, tbf->isSwapped);
 
 if (nBlockCount > 0)
     {
@@ -1240,8 +3317,8 @@ if (nBlockCount > 0)
 
     AllocArray(nStarts, nBlockCount);
     AllocArray(nSizes, nBlockCount);
-    (*tbf->ourMustRead)(tbf->f, nStarts, sizeof(nStarts[0]) * nBlockCount);
-    (*tbf->ourMustRead)(tbf->f, nSizes, sizeof(nSizes[0]) * nBlockCount);
+    tbfMustRead(tbf, nStarts, sizeof(nStarts[0]) * nBlockCount);
+    tbfMustRead(tbf, nSizes, sizeof(nSizes[0]) * nBlockCount);
     if (tbf->isSwapped)
 	{
 	for (i=0; i<nBlockCount; ++i)
@@ -31,6 +31,99 @@ struct twoBitIndex
     bits64 offset;		/* Offset in file. */
     };
 
+#define TWOBIT_SCRATCH_MAX (1024 * 1024)
+/* Reads of up to this many packed bytes go through a buffer that is reused
+ * from one read to the next instead of a buffer allocated for each read. */
+
+#define TWOBIT_HEADER_CACHE_COUNT 16
+/* Default max number of sequence headers kept in a header cache. */
+
+#define TWOBIT_HEADER_CACHE_BYTES (64 * 1024 * 1024)
+/* Default max memory used by the sequence headers in a header cache. */
+
+struct twoBitBlockIndex
+/* Directory of the blocks of N's or of the masked blocks of a sequence, to
+ * find the blocks overlapping a range without a binary search and count the
+ * bases they cover without walking them. */
+    {
+    int blockCount;		/* Number of blocks. */
+    const bits32 *starts;	/* Starts of blocks, owned by the header. */
+    const bits32 *sizes;	/* Sizes of blocks, owned by the header. */
+    int bucketShift;		/* Bucket i starts at base i << bucketShift. */
+    int bucketCount;		/* Number of buckets. */
+    bits32 *firstBlock;		/* First block ending after the start of each bucket. */
+    bits32 *cumSizes;		/* cumSizes[i] is the size of blocks 0 to i-1. */
+    };
+
+struct twoBitCachedHeader
+/* A parsed sequence header (without the data) in a header cache. */
+    {
+    struct twoBitCachedHeader *next;	/* Next less recently used. */
+    struct twoBit *twoBit;	/* Header.  The name belongs to the twoBitFile hash. */
+    bits64 dataOffset;		/* File offset of data for this sequence. */
+    struct twoBitBlockIndex nIndex;	/* Index of blocks of N's. */
+    struct twoBitBlockIndex maskIndex;	/* Index of masked blocks. */
+    size_t bytes;		/* Memory used by this header. */
+    };
+
+struct twoBitHeaderCache
+/* The most recently used sequence headers, including nBlocks and mask
+ * blocks.  Avoids reparsing headers when reads go back and forth between a
+ * few sequences. */
+    {
+    struct twoBitCachedHeader *list;	/* Most recently used first. */
+    int count;			/* Number of headers in list. */
+    size_t bytes;		/* Memory used by headers in list. */
+    int maxCount;		/* Max number of headers, 0 for default. */
+    size_t maxBytes;		/* Max memory used by headers, 0 for default.  The
+    				 * most recently used header is always kept. */
+    };
+
+struct twoBitIOStats
+/* What the reads from a twoBitFile or a twoBitReader cost so far. */
+    {
+    bits64 seekCount;		/* Seeks, absolute or relative. */
+    bits64 readCount;		/* Reads, or fetches from a file in memory. */
+    bits64 bytesRead;		/* Bytes read or fetched. */
+    bits64 headerHits;		/* Sequence headers found in the header cache. */
+    bits64 headerMisses;	/* Sequence headers read from the file. */
+    bits64 fragCount;		/* Fragments decoded. */
+    bits64 basesDecoded;	/* Bases decoded. */
+    bits64 decodeNanos;		/* Nanoseconds spent decoding, if timeDecode is set. */
+    boolean timeDecode;		/* Time decoding with a monotonic clock, which costs
+    				 * two clock reads per fragment.  A setting rather
+				 * than a counter, twoBitIOStatsClear() and
+				 * twoBitIOStatsAdd() leave it alone. */
+    };
+
+struct twoBitIOVec
+/* One of the ranges of a vectored read. */
+    {
+    bits64 offset;		/* Offset of range in file. */
+    void *buf;			/* Where the bytes of range go. */
+    size_t size;		/* Size of range. */
+    };
+
+struct twoBitIOFuncs
+/* Caller-supplied routines to read a .2bit file from wherever it is, see
+ * twoBitOpenCallbacks().  data is what was passed to twoBitOpenCallbacks().
+ * The routines return FALSE on error rather than abort, and readAt and
+ * readv may be called from several threads at once by the readers of the
+ * file (see twoBitReaderNew()). */
+    {
+    boolean (*readAt)(void *data, bits64 offset, void *buf, size_t size);
+	/* Read exactly size bytes at offset into buf.  Required. */
+    boolean (*size)(void *data, bits64 *retSize);
+	/* Put the size of the file in *retSize.  Required. */
+    boolean (*readv)(void *data, const struct twoBitIOVec *vecs, int count);
+	/* Read exactly the count ranges of vecs, in any order, e.g. merging
+	 * ranges that are close to each other into a single request.  The
+	 * ranges are not necessarily sorted and may overlap.  NULL to call
+	 * readAt for each range instead. */
+    void (*close)(void *data);
+	/* Release data, called by twoBitClose().  NULL if nothing to do. */
+    };
+
 struct twoBitFile
 /* Holds header and index info from .2bit file. */
     {
@@ -42,14 +135,23 @@ struct twoBitFile
     bits32 seqCount;	/* Number of sequences. */
     bits32 reserved;	/* Reserved, always zero for now. */
     struct twoBitIndex *indexList;	/* List of sequence. */
+    struct twoBitIndex *indexArray;	/* Same as indexList, as an array in
+    					 * file order.  Allocated in hash. */
+    struct twoBitSeqSummary *summary;	/* Per sequence summary in file order,
+    					 * from summary file if there is an
+					 * up to date one, NULL otherwise. */
     struct hash *hash;	/* Hash of sequences. */
     //struct bptFile *bpt;       /* Alternative index. */
 
         
+    struct twoBitHeaderCache headerCache; /* Recently accessed sequence headers. */
     struct twoBit *seqCache; /* Cache information about last sequence accessed, including
                               * nBlock and mask block.  This doesn't include the data.
-                              * This speeds fragment reads.  */
+                              * This speeds fragment reads.  Owned by headerCache. */
     bits64 dataOffsetCache;  /* file offset of data for seqCache seqeunce */
+    UBYTE *scratch;          /* Reused buffer for packed bytes. */
+    size_t scratchSize;      /* Allocated size of scratch. */
+    struct twoBitIOStats stats; /* I/O done on tbf, and by its readers once freed. */
 
     /* the routines we use to access the twoBit.
      * These may be UDC routines, or stdio
@@ -62,8 +164,112 @@ struct twoBitFile
     void (*ourClose)(void *pFile);
     boolean (*ourFastReadString)(void *f, char buf[256]);
     void (*ourMustRead)(void *file, void *buf, size_t size);
+    size_t (*ourRead)(void *file, void *buf, size_t size);
+                         /* Read up to size bytes, fewer only at end of
+                          * file.  Returns number of bytes read. */
+    UBYTE *(*ourMapAt)(void *file, bits64 offset, size_t size);
+                         /* NULL unless the whole file is in memory, in which
+                          * case it returns a pointer to size bytes at offset,
+                          * or NULL if out of range. */
+    boolean (*ourReadAt)(void *file, bits64 offset, void *buf, size_t size);
+                         /* Positional read that leaves the file position
+                          * alone and returns FALSE rather than abort on
+                          * error.  NULL where not available (Windows). */
+    boolean (*ourReadAtv)(void *file, const struct twoBitIOVec *vecs, int count);
+                         /* Read several ranges at once, like ourReadAt.  NULL
+                          * unless the file was opened with
+                          * twoBitOpenPositional() or twoBitOpenCallbacks(). */
+    };
+
+#define TWOBIT_SUMMARY_SUFFIX ".tbs"
+/* A summary file has the name of its 2bit file plus this suffix. */
+
+struct twoBitSeqSummary
+/* Summary of a sequence header as stored in a summary file: what
+ * twoBitSeqSize() and twoBitSeqSizeNoNs() need, without a seek per
+ * sequence. */
+    {
+    bits32 size;		/* Number of bases. */
+    bits32 nBlockCount;		/* Number of blocks of N's. */
+    bits32 nBaseCount;		/* Number of bases in blocks of N's. */
+    bits32 maskBlockCount;	/* Number of masked blocks. */
+    bits32 maskBaseCount;	/* Number of bases in masked blocks. */
+    bits32 reserved;		/* Always zero for now. */
+    bits64 dataOffset;		/* Offset of packed bases in 2bit file. */
+    };
+
+struct twoBitReader
+/* Private reading state on a twoBitFile shared between threads. */
+    {
+    struct twoBitFile *tbf;	/* Shared file, only read from. */
+    FILE *f;			/* Private handle if no tbf->ourReadAt. */
+    struct twoBitHeaderCache headerCache;	/* Recently read sequence headers. */
+    struct twoBit *seqCache;	/* Header of last sequence read, owned by headerCache. */
+    bits64 dataOffsetCache;	/* File offset of data for seqCache sequence. */
+    UBYTE *scratch;		/* Reused buffer for packed bytes. */
+    size_t scratchSize;		/* Allocated size of scratch. */
+    struct twoBitIOStats stats;	/* I/O done through reader. */
+    char errMsg[512];		/* Describes the last error. */
     };
 
+struct twoBitPacker
+/* State of the single pass conversion of DNA letters to twoBit: packs the
+ * bases and records blocks of N's and of lower case as it goes. */
+    {
+    struct twoBit *twoBit;	/* Sequence being built. */
+    UBYTE *pt;			/* Next packed byte to fill in. */
+    bits32 pos;			/* Number of letters packed so far. */
+    boolean doMask;		/* If TRUE record blocks of lower case. */
+    boolean inN;		/* In a block of N's. */
+    boolean inLower;		/* In a block of lower case. */
+    bits32 nAlloc;		/* Allocated size of N block arrays. */
+    bits32 maskAlloc;		/* Allocated size of mask block arrays. */
+    char carry[4];		/* Letters not packed yet (less than a byte's worth). */
+    int carryCount;		/* Number of letters in carry. */
+    };
+
+struct twoBitWriter
+/* Writes a twoBit file one sequence at a time, so only one sequence needs to
+ * be in memory at once.  The offsets in the index are filled in at the end. */
+    {
+    FILE *f;			/* File being written. */
+    boolean useLong;		/* Use 64 bit offsets in index. */
+    int seqCount;		/* Number of sequences in file. */
+    int seqsWritten;		/* Number of sequences written so far. */
+    char **names;		/* Names of sequences, in file order. */
+    bits64 *offsets;		/* Offsets of sequences written so far. */
+    bits64 nextOffset;		/* Offset of next sequence. */
+    long long dataSize;		/* Total size of sequences written so far. */
+    };
+
+struct twoBitPackedView
+/* Read-only view of part of a sequence in its packed 2-bit form.  Base i of
+ * the view (0 <= i < end-start) is found with twoBitViewBaseVal().  Block
+ * coordinates are relative to the start of the sequence, not of the view. */
+    {
+    const UBYTE *packed;	/* Packed byte holding the first base. */
+    int bitOffset;		/* Bits (0, 2, 4 or 6) to skip in first byte. */
+    int start;			/* Start of view in sequence. */
+    int end;			/* End of view in sequence. */
+    int seqSize;		/* Full size of sequence. */
+    int nBlockCount;		/* Count of blocks of Ns overlapping view. */
+    const bits32 *nStarts;	/* Starts of blocks of Ns. */
+    const bits32 *nSizes;	/* Sizes of blocks of Ns. */
+    int maskBlockCount;		/* Count of masked blocks overlapping view. */
+    const bits32 *maskStarts;	/* Starts of masked regions. */
+    const bits32 *maskSizes;	/* Sizes of masked regions. */
+    UBYTE *packedAlloc;		/* Copy of packed bytes if file not in memory. */
+    struct twoBitIOStats *stats;	/* Stats of the file or reader that made the view. */
+    };
+
+INLINE int twoBitViewBaseVal(const struct twoBitPackedView *view, int i)
+/* Return X_BASE_VAL (see dnautil.h) of base i of view.  Bases in blocks
+ * of Ns come back as T_BASE_VAL. */
+{
+int bit = view->bitOffset + (i << 1);
+return (view->packed[bit >> 3] >> (6 - (bit & 7))) & 3;
+}
+
 struct twoBitSpec
 /* parsed .2bit file and sequence specs */
 {
@@ -89,6 +295,33 @@ struct twoBitFile *twoBitOpen(const char *fileName);
 /* Open file, read in header and index.  
  * Squawk and die if there is a problem. */
 
+struct twoBitFile *twoBitOpenMmap(const char *fileName);
+/* Like twoBitOpen() but map the whole file into memory, so that sequence
+ * data is served as pointers into the mapping rather than with a seek and
+ * a read for each fragment.  Where mmap() is not available (Windows) the
+ * file is read into memory in whole instead.  Close with twoBitClose(). */
+
+struct twoBitFile *twoBitOpenMem(const char *name, const void *data, bits64 size);
+/* Like twoBitOpen() but on a .2bit file image of size bytes at data (e.g.
+ * a file downloaded into memory).  The image is not copied so it must stay
+ * in place and unchanged until twoBitClose().  name is only used in error
+ * messages. */
+
+struct twoBitFile *twoBitOpenPositional(const char *fileName);
+/* Like twoBitOpen() but read the file with pread() at a read position kept
+ * in tbf rather than with stdio, so that a tbf inherited by a forked child
+ * process can be used by both the child and its parent.  Where pread() is
+ * not available (Windows) this is the same as twoBitOpen(). */
+
+struct twoBitFile *twoBitOpenCallbacks(const char *name, const struct twoBitIOFuncs *funcs,
+	void *data);
+/* Like twoBitOpen() but read the file through the routines of funcs (which
+ * is copied), called with data, e.g. to read it from remote storage through
+ * a cache.  Reads are done at a read position kept in tbf like with
+ * twoBitOpenPositional(), and small ones are served from a read-ahead
+ * buffer.  name is only used in error messages.  data is released with
+ * funcs->close by twoBitClose(), but not if opening the file fails. */
+
 // IMPORTANT NOTE: In order to keep Rtwobitlib as small as possible, we removed
 // twoBitOpenExternalBptIndex() from the API!
 //struct twoBitFile *twoBitOpenExternalBptIndex(char *twoBitName, char *bptName);
@@ -99,12 +332,73 @@ struct twoBitFile *twoBitOpen(const char *fileName);
 void twoBitClose(struct twoBitFile **pTbf);
 /* Free up resources associated with twoBitFile. */
 
+void twoBitSetHeaderCache(struct twoBitFile *tbf, int maxCount, size_t maxBytes);
+/* Set the max number of sequence headers and the max memory used by them
+ * in the header cache of tbf (0 for the default).  Also applies to the
+ * readers created on tbf afterwards.  A maxCount of 1 only keeps the header
+ * of the last sequence accessed. */
+
+void twoBitIOStatsClear(struct twoBitIOStats *stats);
+/* Zero the counters of stats. */
+
+void twoBitIOStatsAdd(struct twoBitIOStats *sum, const struct twoBitIOStats *stats);
+/* Add the counters of stats to those of sum. */
+
 boolean twoBitHasSeq(struct twoBitFile *tbf, char *name);
 /* Return TRUE if sequence of given name exists in two bit file */
 
+struct twoBitReader *twoBitReaderNew(struct twoBitFile *tbf);
+/* Return a new reader on tbf.  Readers give a reentrant read path: each
+ * thread creates its own reader on the shared tbf (from the main thread,
+ * as this may abort) and then reads through it without touching the file
+ * position or header cache of tbf.  The twoBitReader* functions never
+ * abort, they report errors in reader->errMsg instead.  Free readers with
+ * twoBitReaderFree() before closing tbf.  The reader times decoding if
+ * tbf->stats.timeDecode is set when it is created. */
+
+void twoBitReaderFree(struct twoBitReader **pReader);
+/* Free up reader, adding its stats to those of its tbf. */
+
+struct dnaSeq *twoBitReaderReadSeqFragExt(struct twoBitReader *reader, char *name,
+	int fragStart, int fragEnd, boolean doMask, int *retFullSize);
+/* Like twoBitReadSeqFragExt() but through reader, so safe to call from several
+ * threads at once as long as each uses its own reader.  Returns NULL with
+ * reader->errMsg set on error.  Free result with dnaSeqFree(). */
+
+boolean twoBitReaderCountBlockBases(struct twoBitReader *reader, char *name,
+	int fragStart, int fragEnd, int *retNCount, int *retMaskCount);
+/* Like twoBitCountBlockBases() but through reader.  Returns FALSE with
+ * reader->errMsg set on error. */
+
+int twoBitReaderReadSeqFragInto(struct twoBitReader *reader, char *name,
+	int fragStart, int fragEnd, boolean doMask, boolean isRc, char *dna);
+/* Like twoBitReadSeqFragInto() but through reader.  Returns -1 with
+ * reader->errMsg set on error. */
+
+boolean twoBitReaderReadPackedView(struct twoBitReader *reader, char *name,
+	int fragStart, int fragEnd, struct twoBitPackedView *view);
+/* Like twoBitReadPackedView() but through reader.  The view is good until
+ * the next read through reader.  Returns FALSE with reader->errMsg set on
+ * error. */
+
 int twoBitSeqSize(struct twoBitFile *tbf, char *name);
 /* Return size of sequence in two bit file in bases. */
 
+char *twoBitSummaryFileName(const char *twoBitName);
+/* Return name of summary file of twoBitName.  FreeMem result when done. */
+
+struct twoBitSeqSummary *twoBitSummaryRead(struct twoBitFile *tbf,
+	const char *fileName);
+/* Read summary file of tbf.  Return NULL if there is no such file, or if it
+ * doesn't look like it was made from the current version of tbf.  The
+ * result has an element per sequence of tbf, in file order.  FreeMem result
+ * when done.  TwoBitOpen() calls this on twoBitSummaryFileName(), so files
+ * with an up to date summary file get their tbf->summary automatically. */
+
+void twoBitSummaryWrite(struct twoBitFile *tbf, const char *fileName);
+/* Read all sequence headers of tbf and write their summary to fileName.
+ * Also attach the summary to tbf. */
+
 long long twoBitTotalSize(struct twoBitFile *tbf);
 /* Return total size of all sequences in two bit file. */
 
@@ -115,6 +409,54 @@ struct dnaSeq *twoBitReadSeqFragExt(struct twoBitFile *tbf, char *name,
  * case if doMask is false, mixed case (repeats in lower)
  * if doMask is true. */
 
+int twoBitReadSeqFragInto(struct twoBitFile *tbf, char *name,
+	int fragStart, int fragEnd, boolean doMask, boolean isRc, char *dna);
+/* Like twoBitReadSeqFragExt() but decode the bases into dna, which must have
+ * room for fragEnd-fragStart bases (the full sequence if fragEnd is 0), and
+ * return the number of bases written.  If isRc is set dna gets the reverse
+ * complement of the fragment (masking is kept), decoded straight from the
+ * packed bytes.  No zero is added at the end of dna.  Once the sequence
+ * header is cached this doesn't allocate any memory for fragments of up to
+ * 4*TWOBIT_SCRATCH_MAX bases. */
+
+void twoBitCountBlockBases(struct twoBitFile *tbf, char *name,
+	int fragStart, int fragEnd, int *retNCount, int *retMaskCount);
+/* Put the number of bases from fragStart to fragEnd of the sequence that
+ * are in blocks of N's in *retNCount, and the number of them that are in
+ * masked blocks in *retMaskCount, without reading the sequence data.  For
+ * the full sequence call with start=end=0.  N's can be masked too. */
+
+void twoBitReadPackedView(struct twoBitFile *tbf, char *name,
+	int fragStart, int fragEnd, struct twoBitPackedView *view);
+/* Fill in view with part of sequence in its packed 2-bit form, without
+ * decoding it.  To view the full sequence call with start=end=0.  For a file
+ * opened with twoBitOpenMmap() no bytes are copied, otherwise the packed
+ * bytes are read into a buffer of tbf that is reused by the next read (or
+ * into view->packedAlloc if there are more than TWOBIT_SCRATCH_MAX of them).
+ * The block arrays point into the sequence header cached in tbf so the view
+ * is only good until the next read from tbf.  Release with
+ * twoBitPackedViewFree(). */
+
+void twoBitReadPackedViews(struct twoBitFile *tbf, char *name, int count,
+	const int *starts, const int *ends, struct twoBitPackedView *views);
+/* Like twoBitReadPackedView() for count ranges of the same sequence, each
+ * with its own view, but with the packed bytes of all the ranges read at
+ * once if the file was opened with twoBitOpenCallbacks() (with a single
+ * call to funcs->readv) or twoBitOpenPositional().  A range is starts[i]
+ * to ends[i], which must not be empty.  Ranges sorted by start make for
+ * sequential reads.  The views are good until the next read from tbf.
+ * Release each with twoBitPackedViewFree(). */
+
+void twoBitPackedViewFree(struct twoBitPackedView *view);
+/* Free up resources held by view (but not view itself). */
+
+void twoBitPackedViewUnpack(const struct twoBitPackedView *view,
+	int fragStart, int fragEnd, boolean doMask, boolean isRc, char *dna);
+/* Unpack bases fragStart to fragEnd of the sequence, which must be within
+ * view, into dna, or their reverse complement if isRc is set.  Blocks of N's
+ * and masking are applied as with twoBitReadSeqFragExt().  No zero is added
+ * at the end of dna. */
+
 struct dnaSeq *twoBitReadSeqFrag(struct twoBitFile *tbf, char *name,
 	int fragStart, int fragEnd);
 /* Read part of sequence from .2bit file.  To read full
@@ -144,6 +486,18 @@ struct twoBit *twoBitFromDnaSeq(struct dnaSeq *seq, boolean doMask);
 /* Convert dnaSeq representation in memory to twoBit representation.
  * If doMask is true interpret lower-case letters as masked. */
 
+struct twoBitPacker *twoBitPackerNew(char *name, int size, boolean doMask);
+/* Start converting a sequence of size letters to twoBit representation.
+ * Feed it the letters with twoBitPackerAdd() in pieces of any size, and
+ * get the result with twoBitPackerFinish().  If doMask is true interpret
+ * lower-case letters as masked. */
+
+void twoBitPackerAdd(struct twoBitPacker *packer, const char *dna, int size);
+/* Pack the next size letters of the sequence. */
+
+struct twoBit *twoBitPackerFinish(struct twoBitPacker **pPacker);
+/* Return the packed sequence and free up packer. */
+
 struct twoBit *twoBitFromFile(const char *fileName);
 /* Get twoBit list of all sequences in twoBit file. */
 
@@ -172,6 +526,29 @@ int twoBitWriteHeaderExt(struct twoBit *twoBitList, FILE *f, boolean useLong, co
  * to support >4Gb assemblies. Return -1 if "name too long" error, -2
  * if "index overflow" error, 0 if everything ok. */
 
+struct twoBitWriter *twoBitWriterOpen(FILE *f, char **names, int seqCount,
+	boolean useLong, const char **msg);
+/* Start writing a twoBit file with seqCount sequences to f.  The names are
+ * needed up front because the index comes first in the file.  Add the
+ * sequences with twoBitWriterAdd() in the same order as names, and finish
+ * with twoBitWriterClose().  If useLong is True, use 64 bit quantities for
+ * the index offsets to support >4Gb assemblies.  Return NULL with *msg set
+ * if a name is too long. */
+
+int twoBitWriterAdd(struct twoBitWriter *writer, struct twoBit *twoBit,
+	const char **msg);
+/* Write out twoBit, which must be the next sequence named when writer was
+ * opened.  Return -1 if it is not, -2 if "index overflow" error (the
+ * sequence is not written then), 0 if everything ok. */
+
+int twoBitWriterClose(struct twoBitWriter **pWriter, const char **msg);
+/* Fill in the offsets in the index and free up writer.  The file itself is
+ * left open, positioned at its end.  Return -1 if not all sequences were
+ * added, 0 if everything ok. */
+
+void twoBitWriterFree(struct twoBitWriter **pWriter);
+/* Free up writer without finishing the file. */
+
 boolean twoBitIsFile(const char *fileName);
 /* Return TRUE if file is in .2bit format. */
 
@@ -0,0 +1,198 @@
+#include "twobit_getseq.h"
+#include "Rtwobitlib_utils.h"
+
+#include <kent/hash.h>  /* for hashFindVal() */
+#include <kent/twoBit.h>
+
+#include <stdlib.h>  /* for qsort() */
+
+
+/****************************************************************************
+ * C_twobit_getseq()
+ */
+
+/* Ranges that are less than this many bases apart are fetched with a
+   single read. Small gaps are cheaper to read through than to seek over. */
+#define COALESCE_MAX_GAP 4096
+
+/* The clusters of ranges on a sequence are read in batches of up to this
+   many packed bytes (4 bases per byte), with a single vectored read for
+   files opened with twoBitOpenPositional() or twoBitOpenCallbacks(). */
+#define BATCH_MAX_PACKED_BYTES (16 * 1024 * 1024)
+
+/* One range to extract. Coordinates are 0-based, end excluded. */
+struct range_task {
+	struct twoBitIndex *index;
+	int start;
+	int end;
+	int i;  /* rank of the range in the input */
+};
+
+static int cmp_range_tasks(const void *p1, const void *p2)
+{
+	const struct range_task *task1 = p1, *task2 = p2;
+
+	/* Order by position in the file. */
+	if (task1->index->offset != task2->index->offset)
+		return task1->index->offset < task2->index->offset ? -1 : 1;
+	if (task1->start != task2->start)
+		return task1->start - task2->start;
+	return task1->end - task2->end;
+}
+
+/* Also checks the ranges against the sequence lengths. */
+static struct range_task *make_range_tasks(SEXP filepath,
+		struct twoBitFile *tbf, SEXP seqnames,
+		const int *start, const int *end)
+{
+	struct range_task *tasks, *task;
+	int ntask, i, seqlen = 0;
+	const char *seqname;
+
+	ntask = LENGTH(seqnames);
+	tasks = (struct range_task *)
+		R_alloc(ntask, sizeof(struct range_task));
+	for (i = 0, task = tasks; i < ntask; i++, task++) {
+		seqname = CHAR(STRING_ELT(seqnames, i));
+		task->index = hashFindVal(tbf->hash, seqname);
+		if (task->index == NULL) {
+			_close_2bit_file(filepath, &tbf);
+			error("sequence \"%s\" is not in the file", seqname);
+		}
+		task->start = start[i] - 1;
+		task->end = end[i];
+		task->i = i;
+	}
+	qsort(tasks, ntask, sizeof(struct range_task), cmp_range_tasks);
+
+	/* Ranges on the same sequence are now next to each other. We only
+	   need to look up the length of each sequence once. */
+	for (i = 0, task = tasks; i < ntask; i++, task++) {
+		if (i == 0 || task->index != task[-1].index)
+			seqlen = twoBitSeqSize(tbf, task->index->name);
+		if (task->end > seqlen) {
+			_close_2bit_file(filepath, &tbf);
+			error("range %d is out of bounds: end (%d) is greater "
+			      "than the length of sequence \"%s\" (%d)",
+			      task->i + 1, task->end, task->index->name,
+			      seqlen);
+		}
+	}
+	return tasks;
+}
+
+/* Extends the cluster of ranges starting at tasks[i] with all the following
+   ranges on the same sequence that overlap it or are close enough. Returns
+   the index of the first range after the cluster. */
+static int extend_cluster(const struct range_task *tasks, int ntask, int i,
+			  int *cluster_start, int *cluster_end)
+{
+	int j;
+
+	*cluster_start = tasks[i].start;
+	*cluster_end = tasks[i].end;
+	for (j = i + 1;
+	     j < ntask && tasks[j].index == tasks[i].index &&
+	     tasks[j].start <= *cluster_end + COALESCE_MAX_GAP;
+	     j++)
+	{
+		if (tasks[j].end > *cluster_end)
+			*cluster_end = tasks[j].end;
+	}
+	return j;
+}
+
+/* --- .Call ENTRY POINT --- */
+SEXP C_twobit_getseq(SEXP filepath, SEXP seqnames, SEXP start, SEXP end,
+		     SEXP minus_strand)
+{
+	struct twoBitFile *tbf;
+	struct range_task *tasks;
+	struct twoBitPackedView *views;
+	int ans_len, max_width, cluster_start, cluster_end, nbatch, c,
+	    i, j, k, next, width, *batch_first, *batch_next,
+	    *batch_starts, *batch_ends;
+	long long batch_bytes;
+	const int *minus;
+	char *buf;
+	SEXP ans, ans_elt;
+
+	tbf = _open_2bit_file(filepath);
+	tasks = make_range_tasks(filepath, tbf, seqnames,
+				 INTEGER(start), INTEGER(end));
+	minus = LOGICAL(minus_strand);
+
+	ans_len = LENGTH(seqnames);
+	max_width = 0;
+	for (k = 0; k < ans_len; k++) {
+		width = tasks[k].end - tasks[k].start;
+		if (width > max_width)
+			max_width = width;
+	}
+	buf = R_alloc(max_width > 0 ? max_width : 1, sizeof(char));
+	/* There are never more clusters than ranges. */
+	views = (struct twoBitPackedView *)
+		R_alloc(ans_len > 0 ? ans_len : 1,
+			sizeof(struct twoBitPackedView));
+	batch_first = (int *) R_alloc(4 * (ans_len > 0 ? ans_len : 1),
+				      sizeof(int));
+	batch_next = batch_first + ans_len;
+	batch_starts = batch_next + ans_len;
+	batch_ends = batch_starts + ans_len;
+
+	ans = PROTECT(NEW_CHARACTER(ans_len));
+	for (i = 0; i < ans_len; i = j) {
+		/* Collect the clusters of ranges on the sequence of
+		   tasks[i], as long as they fit in a batch. */
+		nbatch = 0;
+		batch_bytes = 0;
+		for (j = i;
+		     j < ans_len && tasks[j].index == tasks[i].index;
+		     j = next)
+		{
+			next = extend_cluster(tasks, ans_len, j,
+					      &cluster_start, &cluster_end);
+			if (cluster_end == cluster_start) {
+				/* Only zero-width ranges. */
+				for (k = j; k < next; k++)
+					SET_STRING_ELT(ans, tasks[k].i,
+						       R_BlankString);
+				continue;
+			}
+			if (nbatch > 0 && batch_bytes +
+			    (cluster_end - cluster_start) / 4 >
+			    BATCH_MAX_PACKED_BYTES)
+				break;
+			batch_first[nbatch] = j;
+			batch_next[nbatch] = next;
+			batch_starts[nbatch] = cluster_start;
+			batch_ends[nbatch] = cluster_end;
+			batch_bytes += (cluster_end - cluster_start) / 4 + 1;
+			nbatch++;
+		}
+		if (nbatch == 0)
+			continue;
+		/* Read the packed bases of all the clusters of the batch
+		   at once, each cluster in its own view. */
+		twoBitReadPackedViews(tbf, tasks[i].index->name, nbatch,
+				      batch_starts, batch_ends, views);
+		for (c = 0; c < nbatch; c++) {
+			for (k = batch_first[c]; k < batch_next[c]; k++) {
+				width = tasks[k].end - tasks[k].start;
+				/* Ranges on the minus strand are decoded
+				   straight into their reverse complement. */
+				twoBitPackedViewUnpack(views + c,
+						tasks[k].start, tasks[k].end,
+						TRUE, minus[tasks[k].i], buf);
+				ans_elt = PROTECT(mkCharLen(buf, width));
+				SET_STRING_ELT(ans, tasks[k].i, ans_elt);
+				UNPROTECT(1);
+			}
+			twoBitPackedViewFree(views + c);
+		}
+	}
+
+	_close_2bit_file(filepath, &tbf);
+	UNPROTECT(1);
+	return ans;
+}
@@ -0,0 +1,9 @@
+#ifndef _TWOBIT_GETSEQ_H_
+#define _TWOBIT_GETSEQ_H_
+
+#include <Rdefines.h>
+
+SEXP C_twobit_getseq(SEXP filepath, SEXP seqnames, SEXP start, SEXP end,
+		     SEXP minus_strand);
+
+#endif  /* _TWOBIT_GETSEQ_H_ */
@@ -0,0 +1,125 @@
+#include "twobit_handle.h"
+#include "Rtwobitlib_utils.h"
+
+#include <kent/twoBit.h>
+
+
+/****************************************************************************
+ * The "twobit_handle" objects
+ *
+ * An external pointer to a .2bit file that stays open between calls. The
+ * file is opened with _open_2bit_persistent() so the processes forked by
+ * parallel::mclapply() can all read from the same handle. The file can
+ * also be a raw vector, read in place with twoBitOpenMem().
+ *
+ * address: the struct twoBitFile, or NULL if the handle was closed or
+ *          was serialized (e.g. saveRDS()/readRDS(), or sent to a PSOCK
+ *          worker) in which case the file gets reopened on first use
+ * tag:     the path to the file (character vector of length 1), or the
+ *          raw vector (which the handle keeps alive)
+ * prot:    TRUE once closed with twobit_close(), FALSE otherwise
+ */
+
+static void twobit_handle_finalizer(SEXP xp)
+{
+	struct twoBitFile *tbf = R_ExternalPtrAddr(xp);
+
+	if (tbf == NULL)
+		return;
+	twoBitClose(&tbf);
+	R_ClearExternalPtr(xp);
+	return;
+}
+
+int _is_twobit_handle(SEXP x)
+{
+	return TYPEOF(x) == EXTPTRSXP && inherits(x, "twobit_handle");
+}
+
+static int is_closed(SEXP x)
+{
+	return LOGICAL(R_ExternalPtrProtected(x))[0];
+}
+
+/* The file of a handle that was serialized gets reopened here. */
+struct twoBitFile *_get_twobit_handle_tbf(SEXP x)
+{
+	struct twoBitFile *tbf;
+
+	if (is_closed(x))
+		error("the twobit_handle is closed");
+	tbf = R_ExternalPtrAddr(x);
+	if (tbf != NULL)
+		return tbf;
+	tbf = _open_2bit_persistent(R_ExternalPtrTag(x));
+	R_SetExternalPtrAddr(x, tbf);
+	R_RegisterCFinalizerEx(x, twobit_handle_finalizer, TRUE);
+	return tbf;
+}
+
+
+/****************************************************************************
+ * C_twobit_open()
+ */
+
+/* --- .Call ENTRY POINT --- */
+SEXP C_twobit_open(SEXP filepath)
+{
+	struct twoBitFile *tbf;
+	SEXP closed, ans, ans_class;
+
+	tbf = _open_2bit_persistent(filepath);
+	closed = PROTECT(ScalarLogical(0));
+	ans = PROTECT(R_MakeExternalPtr(tbf, filepath, closed));
+	R_RegisterCFinalizerEx(ans, twobit_handle_finalizer, TRUE);
+	ans_class = PROTECT(mkString("twobit_handle"));
+	setAttrib(ans, R_ClassSymbol, ans_class);
+	UNPROTECT(3);
+	return ans;
+}
+
+
+/****************************************************************************
+ * C_twobit_close()
+ */
+
+/* --- .Call ENTRY POINT --- */
+SEXP C_twobit_close(SEXP x)
+{
+	if (!_is_twobit_handle(x))
+		error("'x' must be a twobit_handle");
+	twobit_handle_finalizer(x);
+	LOGICAL(R_ExternalPtrProtected(x))[0] = 1;
+	return R_NilValue;
+}
+
+
+/****************************************************************************
+ * C_get_twobit_handle_info()
+ */
+
+/* Returns list(source, closed, nseq) where 'source' is the path or the raw
+   vector, and 'nseq' is NA if the file is not currently open (e.g. after
+   deserialization). */
+/* --- .Call ENTRY POINT --- */
+SEXP C_get_twobit_handle_info(SEXP x)
+{
+	struct twoBitFile *tbf;
+	SEXP ans, ans_names;
+
+	if (!_is_twobit_handle(x))
+		error("'x' must be a twobit_handle");
+	tbf = R_ExternalPtrAddr(x);
+	ans = PROTECT(NEW_LIST(3));
+	SET_VECTOR_ELT(ans, 0, R_ExternalPtrTag(x));
+	SET_VECTOR_ELT(ans, 1, ScalarLogical(is_closed(x)));
+	SET_VECTOR_ELT(ans, 2,
+		       ScalarInteger(tbf == NULL ? NA_INTEGER : tbf->seqCount));
+	ans_names = PROTECT(NEW_CHARACTER(3));
+	SET_STRING_ELT(ans_names, 0, mkChar("source"));
+	SET_STRING_ELT(ans_names, 1, mkChar("closed"));
+	SET_STRING_ELT(ans_names, 2, mkChar("nseq"));
+	SET_NAMES(ans, ans_names);
+	UNPROTECT(2);
+	return ans;
+}
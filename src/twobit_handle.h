@@ -0,0 +1,18 @@
+#ifndef _TWOBIT_HANDLE_H_
+#define _TWOBIT_HANDLE_H_
+
+#include <Rdefines.h>
+
+#include <kent/twoBit.h>
+
+int _is_twobit_handle(SEXP x);
+
+struct twoBitFile *_get_twobit_handle_tbf(SEXP x);
+
+SEXP C_twobit_open(SEXP filepath);
+
+SEXP C_twobit_close(SEXP x);
+
+SEXP C_get_twobit_handle_info(SEXP x);
+
+#endif  /* _TWOBIT_HANDLE_H_ */
@@ -0,0 +1,194 @@
+#include "twobit_io_callbacks.h"
+
+#include <kent/twoBit.h>
+
+#include <stdlib.h>  /* for malloc(), free() */
+#include <string.h>  /* for memset(), memcpy(), strcmp() */
+
+
+/****************************************************************************
+ * C_test_twobit_io_callbacks()
+ *
+ * Not used by the package itself: lets the tests open a .2bit file image
+ * held in a raw vector with twoBitOpenCallbacks(), through routines that
+ * serve it from memory, count their calls, and can be made to fail. Only
+ * used on the main thread so the counters are not protected.
+ */
+
+struct mem_source {
+	const unsigned char *data;
+	bits64 size;
+	int reads_left;  /* number of reads before they fail, -1 for no limit */
+	int readat_calls;
+	int readv_calls;
+	int closed;
+};
+
+/* The file and the data passed to its routines. Owned by an external
+   pointer so both get freed if an error is raised while reading. */
+struct test_file {
+	struct twoBitFile *tbf;
+	struct mem_source src;
+};
+
+static boolean take_read(struct mem_source *src)
+{
+	if (src->reads_left == 0)
+		return FALSE;
+	if (src->reads_left > 0)
+		src->reads_left--;
+	return TRUE;
+}
+
+static boolean mem_read_at(void *data, bits64 offset, void *buf, size_t size)
+{
+	struct mem_source *src = data;
+
+	src->readat_calls++;
+	if (!take_read(src) || offset > src->size || size > src->size - offset)
+		return FALSE;
+	memcpy(buf, src->data + offset, size);
+	return TRUE;
+}
+
+static boolean mem_size(void *data, bits64 *ret_size)
+{
+	*ret_size = ((struct mem_source *) data)->size;
+	return TRUE;
+}
+
+static boolean mem_readv(void *data, const struct twoBitIOVec *vecs, int count)
+{
+	struct mem_source *src = data;
+	int i;
+
+	src->readv_calls++;
+	if (!take_read(src))
+		return FALSE;
+	for (i = 0; i < count; i++) {
+		if (vecs[i].offset > src->size ||
+		    vecs[i].size > src->size - vecs[i].offset)
+			return FALSE;
+		memcpy(vecs[i].buf, src->data + vecs[i].offset, vecs[i].size);
+	}
+	return TRUE;
+}
+
+static void mem_close(void *data)
+{
+	((struct mem_source *) data)->closed = 1;
+	return;
+}
+
+static void test_file_finalizer(SEXP xp)
+{
+	struct test_file *file = R_ExternalPtrAddr(xp);
+
+	if (file == NULL)
+		return;
+	if (file->tbf != NULL)
+		twoBitClose(&file->tbf);
+	free(file);
+	R_ClearExternalPtr(xp);
+	return;
+}
+
+static int has_func(SEXP funcs, const char *name)
+{
+	int i;
+
+	for (i = 0; i < LENGTH(funcs); i++)
+		if (strcmp(CHAR(STRING_ELT(funcs, i)), name) == 0)
+			return 1;
+	return 0;
+}
+
+/* Reads the ranges 'start'-'end' (1-based, 'end' included, not empty) of
+   sequence 'seqname' of the .2bit image in raw vector 'x' once with
+   twoBitReadPackedViews() and once with twoBitReadSeqFragInto(). The
+   optional routines that get passed to twoBitOpenCallbacks() are those
+   named in 'funcs' ("size", "readv", "close"), and the reads made after
+   the file is opened fail after the first 'fail_after' (unless it's -1).
+   Returns list(views, frags, readat_calls, readv_calls, closed). */
+/* --- .Call ENTRY POINT --- */
+SEXP C_test_twobit_io_callbacks(SEXP x, SEXP seqname, SEXP start, SEXP end,
+				SEXP funcs, SEXP fail_after)
+{
+	struct twoBitIOFuncs io_funcs;
+	struct test_file *file;
+	struct twoBitPackedView *views;
+	int n, i, width, max_width, *starts, *ends;
+	char *name, *buf;
+	SEXP xp, ans, ans_views, ans_frags, ans_names;
+
+	file = (struct test_file *) malloc(sizeof(struct test_file));
+	if (file == NULL)
+		error("C_test_twobit_io_callbacks: out of memory");
+	memset(file, 0, sizeof(struct test_file));
+	xp = PROTECT(R_MakeExternalPtr(file, R_NilValue, x));
+	R_RegisterCFinalizerEx(xp, test_file_finalizer, TRUE);
+
+	file->src.data = RAW(x);
+	file->src.size = XLENGTH(x);
+	file->src.reads_left = -1;
+	memset(&io_funcs, 0, sizeof(io_funcs));
+	io_funcs.readAt = mem_read_at;
+	if (has_func(funcs, "size"))
+		io_funcs.size = mem_size;
+	if (has_func(funcs, "readv"))
+		io_funcs.readv = mem_readv;
+	if (has_func(funcs, "close"))
+		io_funcs.close = mem_close;
+	file->tbf = twoBitOpenCallbacks("raw vector", &io_funcs, &file->src);
+	file->src.reads_left = INTEGER(fail_after)[0];
+
+	name = (char *) CHAR(STRING_ELT(seqname, 0));
+	n = LENGTH(start);
+	starts = (int *) R_alloc(n, sizeof(int));
+	ends = (int *) R_alloc(n, sizeof(int));
+	max_width = 0;
+	for (i = 0; i < n; i++) {
+		starts[i] = INTEGER(start)[i] - 1;
+		ends[i] = INTEGER(end)[i];
+		if (ends[i] - starts[i] > max_width)
+			max_width = ends[i] - starts[i];
+	}
+	buf = R_alloc(max_width, sizeof(char));
+	ans_views = PROTECT(NEW_CHARACTER(n));
+	ans_frags = PROTECT(NEW_CHARACTER(n));
+
+	views = (struct twoBitPackedView *)
+		R_alloc(n, sizeof(struct twoBitPackedView));
+	twoBitReadPackedViews(file->tbf, name, n, starts, ends, views);
+	for (i = 0; i < n; i++) {
+		width = ends[i] - starts[i];
+		twoBitPackedViewUnpack(views + i, starts[i], ends[i],
+				       TRUE, FALSE, buf);
+		twoBitPackedViewFree(views + i);
+		SET_STRING_ELT(ans_views, i, mkCharLen(buf, width));
+	}
+	for (i = 0; i < n; i++) {
+		width = twoBitReadSeqFragInto(file->tbf, name,
+					      starts[i], ends[i],
+					      TRUE, FALSE, buf);
+		SET_STRING_ELT(ans_frags, i, mkCharLen(buf, width));
+	}
+	twoBitClose(&file->tbf);
+
+	ans = PROTECT(NEW_LIST(5));
+	SET_VECTOR_ELT(ans, 0, ans_views);
+	SET_VECTOR_ELT(ans, 1, ans_frags);
+	SET_VECTOR_ELT(ans, 2, ScalarInteger(file->src.readat_calls));
+	SET_VECTOR_ELT(ans, 3, ScalarInteger(file->src.readv_calls));
+	SET_VECTOR_ELT(ans, 4, ScalarLogical(file->src.closed));
+	ans_names = PROTECT(NEW_CHARACTER(5));
+	SET_STRING_ELT(ans_names, 0, mkChar("views"));
+	SET_STRING_ELT(ans_names, 1, mkChar("frags"));
+	SET_STRING_ELT(ans_names, 2, mkChar("readat_calls"));
+	SET_STRING_ELT(ans_names, 3, mkChar("readv_calls"));
+	SET_STRING_ELT(ans_names, 4, mkChar("closed"));
+	SET_NAMES(ans, ans_names);
+	test_file_finalizer(xp);
+	UNPROTECT(5);
+	return ans;
+}
@@ -0,0 +1,9 @@
+#ifndef _TWOBIT_IO_CALLBACKS_H_
+#define _TWOBIT_IO_CALLBACKS_H_
+
+#include <Rdefines.h>
+
+SEXP C_test_twobit_io_callbacks(SEXP x, SEXP seqname, SEXP start, SEXP end,
+				SEXP funcs, SEXP fail_after);
+
+#endif  /* _TWOBIT_IO_CALLBACKS_H_ */
@@ -0,0 +1,91 @@
+#include "twobit_io_stats.h"
+#include "Rtwobitlib_utils.h"
+#include "twobit_lazy.h"
+#include "twobit_handle.h"
+
+#include <kent/twoBit.h>
+
+
+/****************************************************************************
+ * C_twobit_io_stats()
+ */
+
+static const char *stats_names[] = {
+	"seeks",
+	"reads",
+	"bytes_read",
+	"header_hits",
+	"header_misses",
+	"fragments",
+	"bases_decoded",
+	"decode_seconds"
+};
+
+#define NSTATS (sizeof(stats_names) / sizeof(stats_names[0]))
+
+/* The counters can go beyond INT_MAX so they are returned as doubles. */
+static SEXP new_stats_vector(const struct twoBitIOStats *stats)
+{
+	SEXP ans, ans_names;
+	double *ans_p;
+	int j;
+
+	ans = PROTECT(NEW_NUMERIC(NSTATS));
+	ans_p = REAL(ans);
+	ans_p[0] = (double) stats->seekCount;
+	ans_p[1] = (double) stats->readCount;
+	ans_p[2] = (double) stats->bytesRead;
+	ans_p[3] = (double) stats->headerHits;
+	ans_p[4] = (double) stats->headerMisses;
+	ans_p[5] = (double) stats->fragCount;
+	ans_p[6] = (double) stats->basesDecoded;
+	ans_p[7] = stats->timeDecode ? stats->decodeNanos / 1e9 : NA_REAL;
+	ans_names = PROTECT(NEW_CHARACTER(NSTATS));
+	for (j = 0; j < NSTATS; j++)
+		SET_STRING_ELT(ans_names, j, mkChar(stats_names[j]));
+	SET_NAMES(ans, ans_names);
+	UNPROTECT(2);
+	return ans;
+}
+
+/* --- .Call ENTRY POINT --- */
+SEXP C_twobit_io_stats(SEXP x)
+{
+	const struct twoBitIOStats *stats;
+
+	if (isNull(x))
+		return new_stats_vector(_get_last_io_stats());
+	/* Everything read through the handle since it was opened. */
+	if (_is_twobit_handle(x))
+		return new_stats_vector(&_get_twobit_handle_tbf(x)->stats);
+	stats = _get_lazy_twobit_io_stats(x);
+	if (stats == NULL)
+		error("'x' must be NULL, a twobit_handle, or a character "
+		      "vector returned by twobit_read(..., lazy=TRUE)");
+	return new_stats_vector(stats);
+}
+
+
+/****************************************************************************
+ * C_set_twobit_time_decode()
+ */
+
+/* --- .Call ENTRY POINT --- */
+SEXP C_set_twobit_time_decode(SEXP on)
+{
+	return ScalarLogical(_set_time_decode(LOGICAL(on)[0]));
+}
+
+
+/****************************************************************************
+ * C_set_twobit_use_mmap()
+ */
+
+/* Not exported: lets the tests run the readers on files opened with
+   twoBitOpenMmap(). */
+
+/* --- .Call ENTRY POINT --- */
+SEXP C_set_twobit_use_mmap(SEXP on)
+{
+	return ScalarLogical(_set_use_mmap(LOGICAL(on)[0]));
+}
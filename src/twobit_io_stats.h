@@ -0,0 +1,12 @@
+#ifndef _TWOBIT_IO_STATS_H_
+#define _TWOBIT_IO_STATS_H_
+
+#include <Rdefines.h>
+
+SEXP C_twobit_io_stats(SEXP x);
+
+SEXP C_set_twobit_time_decode(SEXP on);
+
+SEXP C_set_twobit_use_mmap(SEXP on);
+
+#endif  /* _TWOBIT_IO_STATS_H_ */
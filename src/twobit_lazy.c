@@ -0,0 +1,282 @@
+#include "twobit_lazy.h"
+#include "Rtwobitlib_utils.h"
+
+#include <kent/twoBit.h>
+
+#include <R_ext/Altrep.h>
+#include <stdlib.h>  /* for malloc(), free() */
+
+
+/****************************************************************************
+ * The "lazy_twobit" ALTREP class
+ *
+ * A character vector whose elements are the sequences of a .2bit file. The
+ * file is kept open (it's opened with _open_2bit_persistent() so the
+ * vector can be used in the processes forked by parallel::mclapply()) and
+ * a sequence only gets decoded the first time its element is accessed. The decoded sequences are cached, but once the
+ * cache holds more than LAZY_CACHE_MAX_BASES bases the sequences that were
+ * decoded first are dropped from it (they'll get decoded again if accessed
+ * again). Code that asks for a pointer to the data (e.g. sort() or
+ * match()) turns the vector into a regular character vector for good,
+ * which decodes all the sequences and closes the file.
+ *
+ * data1: external pointer to a struct lazy_twobit (its tag is the path to
+ *        the file or the raw vector containing it, kept alive there)
+ * data2: list of the cached CHARSXPs (R_NilValue if not cached), or the
+ *        regular character vector once materialized
+ */
+
+#define LAZY_CACHE_MAX_BASES (512 * 1024 * 1024)
+
+struct lazy_twobit {
+	struct twoBitFile *tbf;  /* NULL once materialized */
+	struct twoBitIndex **indices;  /* one per element, in file order */
+	int n;
+	/* Ring buffer of the cached elements, in the order they were
+	   decoded. */
+	int *decoded;
+	int decoded_start, ndecoded;
+	long long cached_bases;
+	struct twoBitIOStats stats;  /* stats of the file once closed */
+};
+
+static R_altrep_class_t lazy_twobit_class;
+
+static void free_lazy_twobit(struct lazy_twobit *lazy)
+{
+	if (lazy->tbf != NULL)
+		twoBitClose(&lazy->tbf);
+	free(lazy->indices);
+	free(lazy->decoded);
+	free(lazy);
+	return;
+}
+
+static void lazy_twobit_finalizer(SEXP xp)
+{
+	struct lazy_twobit *lazy = R_ExternalPtrAddr(xp);
+
+	if (lazy == NULL)
+		return;
+	free_lazy_twobit(lazy);
+	R_ClearExternalPtr(xp);
+	return;
+}
+
+static struct lazy_twobit *get_lazy_twobit(SEXP x)
+{
+	return (struct lazy_twobit *) R_ExternalPtrAddr(R_altrep_data1(x));
+}
+
+static int is_materialized(SEXP x)
+{
+	return TYPEOF(R_altrep_data2(x)) == STRSXP;
+}
+
+/* Returns a new CHARSXP, not protected. */
+static SEXP decode_elt(struct lazy_twobit *lazy, R_xlen_t i)
+{
+	const void *vmax;
+	char *name, *buf;
+	int size;
+	SEXP ans;
+
+	name = lazy->indices[i]->name;
+	/* twoBitSeqSize() does not load the sequence data in memory. */
+	size = twoBitSeqSize(lazy->tbf, name);
+	if (size == 0)
+		return R_BlankString;
+	vmax = vmaxget();
+	buf = R_alloc(size, sizeof(char));
+	twoBitReadSeqFragInto(lazy->tbf, name, 0, 0, TRUE, FALSE, buf);
+	ans = mkCharLen(buf, size);
+	vmaxset(vmax);
+	return ans;
+}
+
+/* Drops the oldest cached elements until there is room for 'size' more
+   bases in the cache. */
+static void make_room_in_cache(struct lazy_twobit *lazy, SEXP cache,
+			       int size)
+{
+	int j;
+
+	while (lazy->ndecoded > 0 &&
+	       lazy->cached_bases + size > LAZY_CACHE_MAX_BASES)
+	{
+		j = lazy->decoded[lazy->decoded_start];
+		lazy->cached_bases -= LENGTH(VECTOR_ELT(cache, j));
+		SET_VECTOR_ELT(cache, j, R_NilValue);
+		lazy->decoded_start = (lazy->decoded_start + 1) % lazy->n;
+		lazy->ndecoded--;
+	}
+	return;
+}
+
+/* Decodes all the sequences into a regular character vector that replaces
+   the cache, and closes the file. */
+static SEXP materialize(SEXP x)
+{
+	struct lazy_twobit *lazy;
+	SEXP cache, ans, ans_elt;
+	int i;
+
+	if (is_materialized(x))
+		return R_altrep_data2(x);
+	lazy = get_lazy_twobit(x);
+	cache = R_altrep_data2(x);
+	ans = PROTECT(NEW_CHARACTER(lazy->n));
+	for (i = 0; i < lazy->n; i++) {
+		ans_elt = VECTOR_ELT(cache, i);
+		if (ans_elt == R_NilValue)
+			ans_elt = decode_elt(lazy, i);
+		PROTECT(ans_elt);
+		SET_STRING_ELT(ans, i, ans_elt);
+		UNPROTECT(1);
+	}
+	R_set_altrep_data2(x, ans);
+	lazy->stats = lazy->tbf->stats;
+	twoBitClose(&lazy->tbf);
+	UNPROTECT(1);
+	return ans;
+}
+
+static R_xlen_t lazy_twobit_Length(SEXP x)
+{
+	return get_lazy_twobit(x)->n;
+}
+
+static SEXP lazy_twobit_Elt(SEXP x, R_xlen_t i)
+{
+	struct lazy_twobit *lazy;
+	SEXP cache, ans;
+	int size;
+
+	if (is_materialized(x))
+		return STRING_ELT(R_altrep_data2(x), i);
+	lazy = get_lazy_twobit(x);
+	cache = R_altrep_data2(x);
+	ans = VECTOR_ELT(cache, i);
+	if (ans != R_NilValue)
+		return ans;
+	ans = PROTECT(decode_elt(lazy, i));
+	size = LENGTH(ans);
+	make_room_in_cache(lazy, cache, size);
+	SET_VECTOR_ELT(cache, i, ans);
+	lazy->decoded[(lazy->decoded_start + lazy->ndecoded) % lazy->n] = i;
+	lazy->ndecoded++;
+	lazy->cached_bases += size;
+	UNPROTECT(1);
+	return ans;
+}
+
+static void lazy_twobit_Set_elt(SEXP x, R_xlen_t i, SEXP v)
+{
+	SET_STRING_ELT(materialize(x), i, v);
+	return;
+}
+
+static void *lazy_twobit_Dataptr(SEXP x, Rboolean writeable)
+{
+	return (void *) STRING_PTR_RO(materialize(x));
+}
+
+static const void *lazy_twobit_Dataptr_or_null(SEXP x)
+{
+	if (!is_materialized(x))
+		return NULL;
+	return STRING_PTR_RO(R_altrep_data2(x));
+}
+
+static Rboolean lazy_twobit_Inspect(SEXP x, int pre, int deep, int pvec,
+				    void (*inspect_subtree)(SEXP, int, int, int))
+{
+	struct lazy_twobit *lazy = get_lazy_twobit(x);
+
+	if (is_materialized(x))
+		Rprintf(" lazy_twobit (materialized)\n");
+	else
+		Rprintf(" lazy_twobit (%d/%d sequences cached)\n",
+			lazy->ndecoded, lazy->n);
+	return TRUE;
+}
+
+/* Returns NULL if 'x' is not a "lazy_twobit" vector. */
+const struct twoBitIOStats *_get_lazy_twobit_io_stats(SEXP x)
+{
+	struct lazy_twobit *lazy;
+
+	if (!ALTREP(x) || !R_altrep_inherits(x, lazy_twobit_class))
+		return NULL;
+	lazy = get_lazy_twobit(x);
+	return lazy->tbf != NULL ? &lazy->tbf->stats : &lazy->stats;
+}
+
+void _init_lazy_twobit_class(DllInfo *dll)
+{
+	R_altrep_class_t class;
+
+	class = R_make_altstring_class("lazy_twobit", "Rtwobitlib", dll);
+	R_set_altrep_Length_method(class, lazy_twobit_Length);
+	R_set_altrep_Inspect_method(class, lazy_twobit_Inspect);
+	R_set_altvec_Dataptr_method(class, lazy_twobit_Dataptr);
+	R_set_altvec_Dataptr_or_null_method(class, lazy_twobit_Dataptr_or_null);
+	R_set_altstring_Elt_method(class, lazy_twobit_Elt);
+	R_set_altstring_Set_elt_method(class, lazy_twobit_Set_elt);
+	lazy_twobit_class = class;
+	return;
+}
+
+
+/****************************************************************************
+ * C_twobit_read_lazy()
+ */
+
+/* --- .Call ENTRY POINT --- */
+SEXP C_twobit_read_lazy(SEXP filepath)
+{
+	struct twoBitFile *tbf;
+	struct twoBitIndex *index;
+	struct lazy_twobit *lazy;
+	SEXP xp, cache, ans, ans_names, tmp;
+	int n, i;
+
+	tbf = _open_2bit_persistent(filepath);
+	n = tbf->seqCount;
+	lazy = (struct lazy_twobit *) calloc(1, sizeof(struct lazy_twobit));
+	if (lazy != NULL) {
+		lazy->indices = (struct twoBitIndex **)
+			malloc((n > 0 ? n : 1) * sizeof(struct twoBitIndex *));
+		lazy->decoded = (int *) malloc((n > 0 ? n : 1) * sizeof(int));
+	}
+	if (lazy == NULL || lazy->indices == NULL || lazy->decoded == NULL) {
+		twoBitClose(&tbf);
+		if (lazy != NULL) {
+			free(lazy->indices);
+			free(lazy->decoded);
+			free(lazy);
+		}
+		error("twobit_read: out of memory");
+	}
+	lazy->tbf = tbf;
+	lazy->n = n;
+	for (i = 0, index = tbf->indexList; i < n; i++, index = index->next)
+		lazy->indices[i] = index;
+
+	/* From now on 'lazy' (and the file) get released by the finalizer
+	   of 'xp' if something goes wrong. */
+	xp = PROTECT(R_MakeExternalPtr(lazy, filepath, R_NilValue));
+	R_RegisterCFinalizerEx(xp, lazy_twobit_finalizer, TRUE);
+	cache = PROTECT(NEW_LIST(n));
+	ans = PROTECT(R_new_altrep(lazy_twobit_class, xp, cache));
+
+	ans_names = PROTECT(NEW_CHARACTER(n));
+	for (i = 0; i < n; i++) {
+		tmp = PROTECT(mkChar(lazy->indices[i]->name));
+		SET_STRING_ELT(ans_names, i, tmp);
+		UNPROTECT(1);
+	}
+	SET_NAMES(ans, ans_names);
+	UNPROTECT(4);
+	return ans;
+}
@@ -0,0 +1,15 @@
+#ifndef _TWOBIT_LAZY_H_
+#define _TWOBIT_LAZY_H_
+
+#include <Rdefines.h>
+#include <R_ext/Rdynload.h>  /* for DllInfo */
+
+#include <kent/twoBit.h>  /* for struct twoBitIOStats */
+
+void _init_lazy_twobit_class(DllInfo *dll);
+
+const struct twoBitIOStats *_get_lazy_twobit_io_stats(SEXP x);
+
+SEXP C_twobit_read_lazy(SEXP filepath);
+
+#endif  /* _TWOBIT_LAZY_H_ */
@@ -3,68 +3,169 @@
 
 #include <kent/hash.h> /* for newHash(), freeHash(), hashLookup(), hashAdd() */
 #include <kent/dnautil.h>  /* for dnaUtilOpen() */
-#include <kent/dnaseq.h>  /* for dnaSeqFree() */
+#include <kent/dnaseq.h>  /* for struct dnaSeq */
 #include <kent/twoBit.h>
 
 #include <stdio.h>  /* for fopen(), fclose() */
-#include <string.h>  /* for strerror() */
+#include <string.h>  /* for strerror(), strcpy() */
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 
 /****************************************************************************
  * C_twobit_read()
  */
 
-static SEXP load_sequence_as_CHARSXP(struct twoBitFile *tbf, char *name)
+/* With 'as_raw' the sequences are decoded straight into the raw vectors
+   returned to the user, all at once. Otherwise they are decoded in batches
+   into a buffer that is reused from one batch to the next, and copied to
+   CHARSXPs. A batch has 'nthreads' sequences (unless we run out of them),
+   plus as many of the next ones as fit in 'nthreads' times the size of the
+   biggest sequence. The tasks come biggest first so the buffer is never
+   bigger than that, whatever the size of the genome, and the small
+   sequences at the end still get decoded in a few big batches. */
+
+/* Returns the end of the batch of tasks starting at 'batch_start' and puts
+   its number of bases in '*nbases'. */
+static int get_batch_end(const struct seq_task *tasks, int ntask,
+			 int batch_start, int nthreads, long long *nbases)
 {
-	struct dnaSeq *seq;
-	int n;
-	SEXP ans;
-
-	/* twoBitReadSeqFragExt() loads the sequence data in memory. */
-	seq = twoBitReadSeqFragExt(tbf, name, 0, 0, TRUE, &n);
-	ans = PROTECT(mkCharLen(seq->dna, n));
-	dnaSeqFree(&seq);
-	UNPROTECT(1);
-	return ans;
+	long long batch_cap;
+	int batch_end;
+
+	batch_cap = (long long) nthreads * tasks[0].size;
+	*nbases = 0;
+	for (batch_end = batch_start;
+	     batch_end < ntask &&
+	     (batch_end - batch_start < nthreads ||
+	      *nbases + tasks[batch_end].size <= batch_cap);
+	     batch_end++)
+	{
+		*nbases += tasks[batch_end].size;
+	}
+	return batch_end;
+}
+
+/* Decodes the sequence of 'tasks[k]' into 'dests[k]'. Runs on 'nthreads'
+   threads, each of them with its own reader. Returns 0 and copies the first
+   error message to 'errmsg' if something went wrong. Does not touch any
+   R object so it's safe to call with OpenMP. */
+static int decode_sequences(struct twoBitReader **readers, int nthreads,
+			    const struct seq_task *tasks, int ntask,
+			    char **dests, char *errmsg)
+{
+	int k, ok = 1;
+
+#ifdef _OPENMP
+	#pragma omp parallel for schedule(dynamic, 1) num_threads(nthreads)
+#endif
+	for (k = 0; k < ntask; k++) {
+		struct twoBitReader *reader;
+		int t = 0;
+
+		if (tasks[k].size == 0)
+			continue;
+#ifdef _OPENMP
+		t = omp_get_thread_num();
+#endif
+		reader = readers[t];
+		if (twoBitReaderReadSeqFragInto(reader, tasks[k].index->name,
+						0, 0, TRUE, FALSE, dests[k]) >= 0)
+			continue;
+#ifdef _OPENMP
+		#pragma omp critical
+#endif
+		{
+			if (ok)
+				strcpy(errmsg, reader->errMsg);
+			ok = 0;
+		}
+	}
+	return ok;
 }
 
 /* --- .Call ENTRY POINT --- */
-SEXP C_twobit_read(SEXP filepath)
+SEXP C_twobit_read(SEXP filepath, SEXP nthreads, SEXP as_raw)
 {
 	struct twoBitFile *tbf;
-	int ans_len, i;
+	int ans_len, nthreads0, batch_start, batch_end, k, ok;
+	long long nbases, max_nbases;
 	SEXP ans, ans_names, tmp;
-	struct twoBitIndex *index;
+	struct seq_task *tasks;
+	struct twoBitReader **readers;
+	char **dests, *buf;
+	char errmsg[sizeof(((struct twoBitReader *) 0)->errMsg)];
 
 	tbf = _open_2bit_file(filepath);
-
 	ans_len = tbf->seqCount;
-	ans = PROTECT(NEW_CHARACTER(ans_len));
+	nthreads0 = _get_nthreads(nthreads, ans_len);
+	ans = PROTECT(LOGICAL(as_raw)[0] ? NEW_LIST(ans_len)
+					 : NEW_CHARACTER(ans_len));
 	ans_names = PROTECT(NEW_CHARACTER(ans_len));
 	SET_NAMES(ans, ans_names);
 	UNPROTECT(1);
 
-	for (i = 0, index = tbf->indexList;
-	     i < ans_len;
-	     i++, index = index->next)
-	{
-		if (index == NULL) {  /* should never happen */
-			twoBitClose(&tbf);
+	tasks = _make_seq_tasks(filepath, tbf, "C_twobit_read");
+	for (k = 0; k < ans_len; k++) {
+		tmp = PROTECT(mkChar(tasks[k].index->name));
+		SET_STRING_ELT(ans_names, tasks[k].i, tmp);
+		UNPROTECT(1);
+	}
+
+	readers = _new_twoBitReaders(tbf, nthreads0);
+	dests = (char **) R_alloc(ans_len, sizeof(char *));
+	if (LOGICAL(as_raw)[0]) {
+		/* R objects are only created on the main thread. */
+		for (k = 0; k < ans_len; k++) {
+			tmp = PROTECT(NEW_RAW(tasks[k].size));
+			SET_VECTOR_ELT(ans, tasks[k].i, tmp);
 			UNPROTECT(1);
-			error("Rtwobitlib internal error in "
-			      "C_twobit_read():\n"
-			      "    index == NULL");
+			dests[k] = (char *) RAW(tmp);
+		}
+		ok = decode_sequences(readers, nthreads0, tasks, ans_len,
+				      dests, errmsg);
+	} else {
+		max_nbases = 0;
+		for (batch_start = 0; batch_start < ans_len;
+		     batch_start = batch_end)
+		{
+			batch_end = get_batch_end(tasks, ans_len, batch_start,
+						  nthreads0, &nbases);
+			if (nbases > max_nbases)
+				max_nbases = nbases;
+		}
+		buf = R_alloc(max_nbases, sizeof(char));
+		ok = 1;
+		for (batch_start = 0; ok && batch_start < ans_len;
+		     batch_start = batch_end)
+		{
+			batch_end = get_batch_end(tasks, ans_len, batch_start,
+						  nthreads0, &nbases);
+			nbases = 0;
+			for (k = batch_start; k < batch_end; k++) {
+				dests[k] = buf + nbases;
+				nbases += tasks[k].size;
+			}
+			ok = decode_sequences(readers, nthreads0,
+					      tasks + batch_start,
+					      batch_end - batch_start,
+					      dests + batch_start, errmsg);
+			/* R objects are only created on the main thread. */
+			for (k = batch_start; ok && k < batch_end; k++) {
+				tmp = PROTECT(mkCharLen(dests[k],
+							tasks[k].size));
+				SET_STRING_ELT(ans, tasks[k].i, tmp);
+				UNPROTECT(1);
+			}
 		}
-		tmp = PROTECT(mkChar(index->name));
-		SET_STRING_ELT(ans_names, i, tmp);
-		UNPROTECT(1);
-		tmp = PROTECT(load_sequence_as_CHARSXP(tbf, index->name));
-		SET_STRING_ELT(ans, i, tmp);
-		UNPROTECT(1);
 	}
 
-	twoBitClose(&tbf);
+	_free_twoBitReaders(readers, nthreads0);
+	_close_2bit_file(filepath, &tbf);
 	UNPROTECT(1);
+	if (!ok)
+		error("%s", errmsg);
 	return ans;
 }
 
@@ -112,13 +213,13 @@ static int check_input_sequence(SEXP x_elt, SEXP x_names_elt,
 	return 0;
 }
 
-static struct twoBit *make_twoBitList_from_STRSXP(SEXP x, boolean skip_dups)
+/* Returns the number of sequences to write and their indices in 'x' in
+   '*keep'. Arrays are allocated with R_alloc(). */
+static int select_sequences_to_write(SEXP x, boolean skip_dups, int **keep)
 {
 	SEXP x_names, x_elt, x_names_elt;
-	struct twoBit *twoBitList = NULL, *twoBit;
 	struct hash *uniqHash;
-	int x_len, i, ret;
-	struct dnaSeq seq;
+	int x_len, nkeep, i, ret;
 	const char *msg;
 
 	if (!IS_CHARACTER(x))
@@ -128,77 +229,94 @@ static struct twoBit *make_twoBitList_from_STRSXP(SEXP x, boolean skip_dups)
 		error("'x' must have names");
 	uniqHash = newHash(18);
 	x_len = LENGTH(x);
-	for (i = 0; i < x_len; i++) {
+	*keep = (int *) R_alloc(x_len, sizeof(int));
+	for (i = nkeep = 0; i < x_len; i++) {
 		x_elt = STRING_ELT(x, i);
 		x_names_elt = STRING_ELT(x_names, i);
 		ret = check_input_sequence(x_elt, x_names_elt,
 					   skip_dups, uniqHash, &msg);
 		if (ret < 0) {
 			freeHash(&uniqHash);
-			twoBitFreeList(&twoBitList);
 			error("%s", msg);
 		}
 		if (ret > 0) {
 			warning("%s ==> skipping it", msg);
 			continue;
 		}
-
-		/* We discard the 'const' qualifier to avoid a compilation
-		   warning. Safe to do here because twoBitFromDnaSeq() will
-		   actually treat 'seq.dna' and 'seq.name' as 'const char *'. */
-		seq.dna = (char *) CHAR(x_elt);
-		seq.name = (char *) CHAR(x_names_elt);
-		seq.size = LENGTH(x_elt);
-
-		twoBit = twoBitFromDnaSeq(&seq, TRUE);
-		slAddHead(&twoBitList, twoBit);
+		(*keep)[nkeep++] = i;
 	}
 	freeHash(&uniqHash);
-	slReverse(&twoBitList);
-	return twoBitList;
+	return nkeep;
 }
 
 /* --- .Call ENTRY POINT --- */
 SEXP C_twobit_write(SEXP x, SEXP filepath, SEXP use_long, SEXP skip_dups)
 {
-	const char *path;
-	struct twoBit *twoBitList, *twoBit;
+	const char *path, *msg;
+	SEXP x_names;
+	int nkeep, k, i, ret, *keep;
+	char **names;
+	struct twoBitWriter *writer;
+	struct twoBit *twoBit;
+	struct dnaSeq seq;
 	FILE *f;
-	int ret;
-	const char *msg;
 
 	path = _filepath2str(filepath);
 
 	dnaUtilOpen();
 
-	/* Preprocess the data to write. */
-	twoBitList = make_twoBitList_from_STRSXP(x, LOGICAL(skip_dups)[0]);
+	/* Check the data to write. */
+	nkeep = select_sequences_to_write(x, LOGICAL(skip_dups)[0], &keep);
+	x_names = GET_NAMES(x);
+	names = (char **) R_alloc(nkeep, sizeof(char *));
+	for (k = 0; k < nkeep; k++) {
+		/* twoBitWriterOpen() keeps its own copy of the names. */
+		names[k] = (char *) CHAR(STRING_ELT(x_names, keep[k]));
+	}
 
 	/* Open destination file. */
 	f = fopen(path, "wb");
-	if (f == NULL) {
-		twoBitFreeList(&twoBitList);
+	if (f == NULL)
 		error("cannot open %s to write: %s", path, strerror(errno));
-	}
 
-	/* Write data to destination file. */
-	ret = twoBitWriteHeaderExt(twoBitList, f, LOGICAL(use_long)[0], &msg);
-	if (ret < 0) {
-		fclose(f);
-		twoBitFreeList(&twoBitList);
-		if (ret != -2 || LOGICAL(use_long)[0])
-			error("%s", msg);
-		/* index overflow error */
-		error("%s\nCall twobit_write() again "
-		      "with 'use.long=TRUE'.", msg);
+	/* Write the header and the index. The offsets in the index get
+	   filled in once all the sequences have been written. */
+	writer = twoBitWriterOpen(f, names, nkeep,
+				  LOGICAL(use_long)[0], &msg);
+	if (writer == NULL)
+		_abort_twobit_write(f, path, -1, LOGICAL(use_long)[0], msg,
+				    "twobit_write");
+
+	/* Write the sequences one at a time so only one packed sequence
+	   is in memory at any given time. */
+	for (k = 0; k < nkeep; k++) {
+		i = keep[k];
+		/* We discard the 'const' qualifier to avoid a compilation
+		   warning. Safe to do here because twoBitFromDnaSeq() will
+		   actually treat 'seq.dna' and 'seq.name' as 'const char *'. */
+		seq.dna = (char *) CHAR(STRING_ELT(x, i));
+		seq.name = names[k];
+		seq.size = LENGTH(STRING_ELT(x, i));
+
+		twoBit = twoBitFromDnaSeq(&seq, TRUE);
+		ret = twoBitWriterAdd(writer, twoBit, &msg);
+		/* twoBitFree() does not free the name. */
+		freez(&twoBit->name);
+		twoBitFree(&twoBit);
+		if (ret < 0) {
+			twoBitWriterFree(&writer);
+			_abort_twobit_write(f, path, ret, LOGICAL(use_long)[0],
+					    msg, "twobit_write");
+		}
 	}
 
-	for (twoBit = twoBitList; twoBit != NULL; twoBit = twoBit->next)
-		twoBitWriteOne(twoBit, f);
+	ret = twoBitWriterClose(&writer, &msg);
+	if (ret < 0)
+		_abort_twobit_write(f, path, ret, LOGICAL(use_long)[0], msg,
+				    "twobit_write");
 
-	/* Close file and free memory. */
-	fclose(f);
-	twoBitFreeList(&twoBitList);
+	/* Close file. */
+	if (fclose(f) != 0)
+		error("error writing %s: %s", path, strerror(errno));
 	return R_NilValue;
 }
-
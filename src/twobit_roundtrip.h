@@ -3,7 +3,7 @@
 
 #include <Rdefines.h>
 
-SEXP C_twobit_read(SEXP filepath);
+SEXP C_twobit_read(SEXP filepath, SEXP nthreads, SEXP as_raw);
 
 SEXP C_twobit_write(SEXP x, SEXP filepath, SEXP use_long, SEXP skip_dups);
 
@@ -1,10 +1,13 @@
 #include "twobit_seqstats.h"
 #include "Rtwobitlib_utils.h"
 
-#include <kent/dnaseq.h>  /* for dnaSeqFree() */
+#include <kent/dnautil.h>  /* for X_BASE_VAL constants */
 #include <kent/twoBit.h>
 
-#include <string.h>  /* for memset() */
+#include <string.h>  /* for memset(), memcpy(), strcpy() */
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 
 /****************************************************************************
@@ -33,49 +36,132 @@ static SEXP make_seqstats_dimnames(SEXP rownames)
 	return dimnames;
 }
 
-/* Map 'a', 'c', 'g', 't', 'n' to 0, 1, 2, 3, 4 respectively. */
-static inline int encode_dna_letter(unsigned char c)
+/* Add to 'counts' (indexed by X_BASE_VAL, see kent/dnautil.h) the number
+   of bases of each kind found in bases 'from' to 'to' (0-based, end
+   excluded) of 'view'. */
+static void count_packed_bases(const struct twoBitPackedView *view,
+			       int from, int to, int *counts)
 {
-	static const int map[] = {  0, -1,  1, -1, -1, -1,  2, -1, -1, -1,
-				   -1, -1, -1,  4, -1, -1, -1, -1, -1,  3};
+	const unsigned long long lo_bits = 0x5555555555555555ULL;
+	const UBYTE *p;
+	unsigned long long word, hi, lo;
+	int nwords, k, a, c, g;
 
-	if (c < 'a' || c > 't')
-		return -1;
-	return map[c - 'a'];
+	/* Count one at a time up to the first full byte. */
+	while (from < to && ((view->bitOffset + 2 * from) & 7) != 0)
+		counts[twoBitViewBaseVal(view, from++)]++;
+
+	/* Then count 32 bases (one 64-bit word) at a time. A base value is
+	   2 * hi + lo so each kind of base can be counted with a popcount
+	   of the high bits AND the low bits (or their complements). */
+	p = view->packed + ((view->bitOffset + 2 * from) >> 3);
+	nwords = (to - from) / 32;
+	a = c = g = 0;
+	for (k = 0; k < nwords; k++, p += 8) {
+		memcpy(&word, p, sizeof(word));
+		hi = (word >> 1) & lo_bits;
+		lo = word & lo_bits;
+		a += __builtin_popcountll(hi & ~lo);
+		c += __builtin_popcountll(~hi & lo);
+		g += __builtin_popcountll(hi & lo);
+	}
+	counts[A_BASE_VAL] += a;
+	counts[C_BASE_VAL] += c;
+	counts[G_BASE_VAL] += g;
+	counts[T_BASE_VAL] += 32 * nwords - a - c - g;
+	from += 32 * nwords;
+
+	/* Count the remaining bases one at a time. */
+	while (from < to)
+		counts[twoBitViewBaseVal(view, from++)]++;
+	return;
+}
+
+/* Fill the row of the seqstats matrix that starts at 'out' with the length
+   and A/C/G/T/N counts of the sequence in 'view'. The counts are computed
+   directly from the packed bases: the bases hidden under the blocks of Ns
+   (usually stored as T's) are counted like the others and then moved to
+   the N column. */
+static void tabulate_sequence_letters(const struct twoBitPackedView *view,
+				      int *out, int out_nrow)
+{
+	int counts[4], n_counts[4], nletters, i, b;
+
+	memset(counts, 0, sizeof(counts));
+	memset(n_counts, 0, sizeof(n_counts));
+	count_packed_bases(view, 0, view->seqSize, counts);
+	nletters = 0;
+	for (i = 0; i < view->nBlockCount; i++) {
+		count_packed_bases(view, view->nStarts[i],
+				   view->nStarts[i] + view->nSizes[i], n_counts);
+		nletters += view->nSizes[i];
+	}
+	for (b = 0; b < 4; b++)
+		counts[b] -= n_counts[b];
+
+	out[0] = view->seqSize;
+	out[out_nrow] = counts[A_BASE_VAL];
+	out[2 * out_nrow] = counts[C_BASE_VAL];
+	out[3 * out_nrow] = counts[G_BASE_VAL];
+	out[4 * out_nrow] = counts[T_BASE_VAL];
+	out[5 * out_nrow] = nletters;
+	return;
 }
 
-static int tabulate_sequence_letters(struct twoBitFile *tbf, char *name,
-				     int *out, int out_nrow)
+/* Runs on 'nthreads' threads, each of them with its own reader. Returns 0
+   and copies the first error message to 'errmsg' if something went wrong.
+   Does not touch any R object so it's safe to call with OpenMP. */
+static int tabulate_sequences(struct twoBitReader **readers, int nthreads,
+			      const struct seq_task *tasks, int ntask,
+			      int *out, int out_nrow, char *errmsg)
 {
-	struct dnaSeq *seq;
-	int i, code;
-
-	/* twoBitReadSeqFragExt() loads the sequence data in memory. */
-	seq = twoBitReadSeqFragExt(tbf, name, 0, 0, FALSE, out);
-	out += out_nrow;
-	for (i = 0; i < seq->size; i++) {
-		code = encode_dna_letter((unsigned char) seq->dna[i]);
-		if (code < 0) {
-			dnaSeqFree(&seq);
-			return -1;
+	int k, ok = 1;
+
+#ifdef _OPENMP
+	#pragma omp parallel for schedule(dynamic, 1) num_threads(nthreads)
+#endif
+	for (k = 0; k < ntask; k++) {
+		struct twoBitReader *reader;
+		struct twoBitPackedView view;
+		int t = 0;
+
+#ifdef _OPENMP
+		t = omp_get_thread_num();
+#endif
+		reader = readers[t];
+		/* twoBitReaderReadPackedView() does not decode the sequence. */
+		if (!twoBitReaderReadPackedView(reader, tasks[k].index->name,
+						0, 0, &view))
+		{
+#ifdef _OPENMP
+			#pragma omp critical
+#endif
+			{
+				if (ok)
+					strcpy(errmsg, reader->errMsg);
+				ok = 0;
+			}
+			continue;
 		}
-		out[code * out_nrow]++;
+		tabulate_sequence_letters(&view, out + tasks[k].i, out_nrow);
+		twoBitPackedViewFree(&view);
 	}
-	dnaSeqFree(&seq);
-	return 0;
+	return ok;
 }
 
 /* --- .Call ENTRY POINT --- */
-SEXP C_get_twobit_seqstats(SEXP filepath)
+SEXP C_get_twobit_seqstats(SEXP filepath, SEXP nthreads)
 {
 	struct twoBitFile *tbf;
-	int ans_nrow, i, ret;
+	int ans_nrow, nthreads0, k, ok;
 	SEXP ans, ans_rownames, ans_dimnames, seqname;
-	struct twoBitIndex *index;
+	struct seq_task *tasks;
+	struct twoBitReader **readers;
+	char errmsg[sizeof(((struct twoBitReader *) 0)->errMsg)];
 
 	tbf = _open_2bit_file(filepath);
-
 	ans_nrow = tbf->seqCount;
+	nthreads0 = _get_nthreads(nthreads, ans_nrow);
 	ans = PROTECT(allocMatrix(INTSXP, ans_nrow, stats_ncol));
 	ans_rownames = PROTECT(NEW_CHARACTER(ans_nrow));
 	ans_dimnames = PROTECT(make_seqstats_dimnames(ans_rownames));
@@ -83,32 +169,21 @@ SEXP C_get_twobit_seqstats(SEXP filepath)
 	UNPROTECT(2);
 
 	memset(INTEGER(ans), 0, sizeof(int) * XLENGTH(ans));
-	for (i = 0, index = tbf->indexList;
-	     i < ans_nrow;
-	     i++, index = index->next)
-	{
-		if (index == NULL) {  /* should never happen */
-			twoBitClose(&tbf);
-			UNPROTECT(1);
-			error("Rtwobitlib internal error in "
-			      "C_get_twobit_seqstats():\n"
-			      "    index == NULL");
-		}
-		seqname = PROTECT(mkChar(index->name));
-		SET_STRING_ELT(ans_rownames, i, seqname);
+	tasks = _make_seq_tasks(filepath, tbf, "C_get_twobit_seqstats");
+	for (k = 0; k < ans_nrow; k++) {
+		seqname = PROTECT(mkChar(tasks[k].index->name));
+		SET_STRING_ELT(ans_rownames, tasks[k].i, seqname);
 		UNPROTECT(1);
-		ret = tabulate_sequence_letters(tbf, index->name,
-						INTEGER(ans) + i, ans_nrow);
-		if (ret < 0) {
-			twoBitClose(&tbf);
-			UNPROTECT(1);
-			error("DNA sequences in .2bit file contain "
-			      "unrecognized letters");
-		}
 	}
 
-	twoBitClose(&tbf);
+	readers = _new_twoBitReaders(tbf, nthreads0);
+	ok = tabulate_sequences(readers, nthreads0, tasks, ans_nrow,
+				INTEGER(ans), ans_nrow, errmsg);
+	_free_twoBitReaders(readers, nthreads0);
+	_close_2bit_file(filepath, &tbf);
 	UNPROTECT(1);
+	if (!ok)
+		error("%s", errmsg);
 	return ans;
 }
 
@@ -138,7 +213,7 @@ SEXP C_get_twobit_seqlengths(SEXP filepath)
 	     i++, index = index->next)
 	{
 		if (index == NULL) {  /* should never happen */
-			twoBitClose(&tbf);
+			_close_2bit_file(filepath, &tbf);
 			UNPROTECT(1);
 			error("Rtwobitlib internal error in "
 			      "C_get_twobit_seqlengths():\n"
@@ -151,7 +226,30 @@ SEXP C_get_twobit_seqlengths(SEXP filepath)
 		INTEGER(ans)[i] = twoBitSeqSize(tbf, index->name);
 	}
 
-	twoBitClose(&tbf);
+	_close_2bit_file(filepath, &tbf);
+	UNPROTECT(1);
+	return ans;
+}
+
+
+/****************************************************************************
+ * C_twobit_summarize()
+ */
+
+/* --- .Call ENTRY POINT --- */
+SEXP C_twobit_summarize(SEXP filepath)
+{
+	struct twoBitFile *tbf;
+	char *path;
+	SEXP ans;
+
+	tbf = _open_2bit_file(filepath);
+	path = twoBitSummaryFileName(tbf->fileName);
+	/* Reads the header of every sequence (but not the sequence data). */
+	twoBitSummaryWrite(tbf, path);
+	_close_2bit_file(filepath, &tbf);
+	ans = PROTECT(mkString(path));
+	freeMem(path);
 	UNPROTECT(1);
 	return ans;
 }
@@ -3,9 +3,11 @@
 
 #include <Rdefines.h>
 
-SEXP C_get_twobit_seqstats(SEXP filepath);
+SEXP C_get_twobit_seqstats(SEXP filepath, SEXP nthreads);
 
 SEXP C_get_twobit_seqlengths(SEXP filepath);
 
+SEXP C_twobit_summarize(SEXP filepath);
+
 #endif  /* _TWOBIT_SEQSTATS_H_ */
 
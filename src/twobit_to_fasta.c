@@ -0,0 +1,319 @@
+#include "twobit_to_fasta.h"
+#include "Rtwobitlib_utils.h"
+
+#include <kent/twoBit.h>
+
+#include <zlib.h>  /* for deflateInit2(), deflate(), deflateEnd() */
+#include <stdio.h>  /* for fopen(), fwrite(), fclose(), remove() */
+#include <stdlib.h>  /* for malloc(), free() */
+#include <string.h>  /* for strerror(), strcpy(), strlen(), memcpy() */
+#include <errno.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+
+/****************************************************************************
+ * C_twobit_to_fasta()
+ *
+ * The sequences are cut into chunks of about CHUNK_MIN_BASES bases (a
+ * whole number of lines, unless the lines are longer than CHUNK_MIN_BASES
+ * in which case they span several chunks) that are decoded and formatted
+ * in parallel,
+ * in batches of BATCH_CHUNKS_PER_THREAD chunks per thread. The chunks of a
+ * batch are written to the output file in order by the main thread. So
+ * no more than one batch of formatted chunks is held in memory at any
+ * given time, whatever the size of the sequences.
+ *
+ * When compressing, each chunk is compressed by the thread that formatted
+ * it as a standalone gzip member. A sequence of gzip members is a valid
+ * gzip file (this is what pigz or bgzip produce) so the result can be read
+ * with gzfile(), zcat, fasta_to_twobit(), etc...
+ */
+
+#define CHUNK_MIN_BASES (1024 * 1024)
+#define BATCH_CHUNKS_PER_THREAD 4
+
+struct fasta_chunk {
+	struct twoBitIndex *index;
+	int seq_size;
+	int start, end;  /* 0-based, end excluded */
+	char *out;       /* formatted (and maybe compressed) chunk, malloc'ed */
+	size_t out_size;
+};
+
+/* Returns the chunks of all the sequences, in the order of the file.
+   The array is allocated with R_alloc(). */
+static struct fasta_chunk *make_fasta_chunks(struct twoBitFile *tbf,
+					     int chunk_bases, int *nchunk)
+{
+	struct twoBitIndex *index;
+	struct fasta_chunk *chunks;
+	int n, size, start, k;
+
+	n = 0;
+	for (index = tbf->indexList; index != NULL; index = index->next) {
+		/* twoBitSeqSize() does not load the sequence data
+		   in memory. */
+		size = twoBitSeqSize(tbf, index->name);
+		n += size == 0 ? 1 : (size - 1) / chunk_bases + 1;
+	}
+	chunks = (struct fasta_chunk *) R_alloc(n, sizeof(struct fasta_chunk));
+	k = 0;
+	for (index = tbf->indexList; index != NULL; index = index->next) {
+		size = twoBitSeqSize(tbf, index->name);
+		start = 0;
+		do {
+			chunks[k].index = index;
+			chunks[k].seq_size = size;
+			chunks[k].start = start;
+			chunks[k].end = size - start > chunk_bases ?
+					start + chunk_bases : size;
+			chunks[k].out = NULL;
+			chunks[k].out_size = 0;
+			start = chunks[k++].end;
+		} while (start < size);
+	}
+	*nchunk = n;
+	return chunks;
+}
+
+/* Compresses 'in' as a standalone gzip member. Returns NULL on error. */
+static char *gzip_member(const char *in, size_t in_size, size_t *out_size)
+{
+	z_stream zs;
+	char *out;
+	size_t bound;
+	int ret;
+
+	memset(&zs, 0, sizeof(zs));
+	/* 15 + 16 means a 32K window with a gzip header and trailer. */
+	if (deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8,
+			 Z_DEFAULT_STRATEGY) != Z_OK)
+		return NULL;
+	bound = deflateBound(&zs, in_size);
+	out = (char *) malloc(bound);
+	if (out == NULL) {
+		deflateEnd(&zs);
+		return NULL;
+	}
+	zs.next_in = (Bytef *) in;
+	zs.avail_in = in_size;
+	zs.next_out = (Bytef *) out;
+	zs.avail_out = bound;
+	ret = deflate(&zs, Z_FINISH);
+	*out_size = zs.total_out;
+	deflateEnd(&zs);
+	if (ret != Z_STREAM_END) {
+		free(out);
+		return NULL;
+	}
+	return out;
+}
+
+/* Like formatSeqWithBreaks() but for the bases of 'chunk', which can start
+   or end in the middle of a line: a newline follows every base that ends
+   a line or the sequence. Returns the number of bytes written to 'out',
+   or that would be written if 'out' is NULL. */
+static size_t format_chunk_lines(char *out, const char *dna,
+				 const struct fasta_chunk *chunk,
+				 int line_width)
+{
+	long long pos, line_end;
+	size_t out_size = 0;
+	int n;
+
+	for (pos = chunk->start; pos < chunk->end; pos += n) {
+		line_end = (pos / line_width + 1) * line_width;
+		if (line_end > chunk->seq_size)
+			line_end = chunk->seq_size;
+		n = (line_end < chunk->end ? line_end : chunk->end) - pos;
+		if (out != NULL) {
+			memcpy(out + out_size, dna + (pos - chunk->start), n);
+			if (pos + n == line_end)
+				out[out_size + n] = '\n';
+		}
+		out_size += n + (pos + n == line_end);
+	}
+	return out_size;
+}
+
+/* Decodes and formats 'chunk' (and compresses it if 'compress' is set).
+   'dna' must have room for the bases of the chunk. Returns 0 and sets
+   'errmsg' on error. Does not touch any R object. */
+static int format_chunk(struct twoBitReader *reader, struct fasta_chunk *chunk,
+			int line_width, int compress, char *dna, char *errmsg)
+{
+	struct twoBitPackedView view;
+	const char *name = chunk->index->name;
+	size_t name_len, out_size;
+	int width;
+	char *out, *p;
+
+	width = chunk->end - chunk->start;
+	if (width != 0) {
+		if (!twoBitReaderReadPackedView(reader, chunk->index->name,
+						chunk->start, chunk->end,
+						&view))
+		{
+			strcpy(errmsg, reader->errMsg);
+			return 0;
+		}
+		twoBitPackedViewUnpack(&view, chunk->start, chunk->end,
+				       TRUE, FALSE, dna);
+		twoBitPackedViewFree(&view);
+	}
+
+	/* Only the first chunk of a sequence gets the header line. */
+	name_len = chunk->start == 0 ? strlen(name) : 0;
+	out_size = (chunk->start == 0 ? name_len + 2 : 0) +
+		   format_chunk_lines(NULL, dna, chunk, line_width);
+	out = (char *) malloc(out_size);
+	if (out == NULL) {
+		strcpy(errmsg, "twobit_to_fasta: out of memory");
+		return 0;
+	}
+	p = out;
+	if (chunk->start == 0) {
+		*p++ = '>';
+		memcpy(p, name, name_len);
+		p += name_len;
+		*p++ = '\n';
+	}
+	format_chunk_lines(p, dna, chunk, line_width);
+
+	if (compress) {
+		chunk->out = gzip_member(out, out_size, &chunk->out_size);
+		free(out);
+		if (chunk->out == NULL) {
+			strcpy(errmsg, "twobit_to_fasta: compression failed");
+			return 0;
+		}
+	} else {
+		chunk->out = out;
+		chunk->out_size = out_size;
+	}
+	return 1;
+}
+
+/* Runs on 'nthreads' threads, each of them with its own reader and its
+   own 'chunk_bases'-sized decoding buffer. Returns 0 and copies the first
+   error message to 'errmsg' if something went wrong. Does not touch any
+   R object so it's safe to call with OpenMP. */
+static int format_chunks(struct twoBitReader **readers, char **dna_bufs,
+			 int nthreads, struct fasta_chunk *chunks, int nchunk,
+			 int line_width, int compress, char *errmsg)
+{
+	int k, ok = 1;
+
+#ifdef _OPENMP
+	#pragma omp parallel for schedule(dynamic, 1) num_threads(nthreads)
+#endif
+	for (k = 0; k < nchunk; k++) {
+		char thread_errmsg[sizeof(((struct twoBitReader *) 0)->errMsg)];
+		int t = 0;
+
+#ifdef _OPENMP
+		t = omp_get_thread_num();
+#endif
+		if (format_chunk(readers[t], chunks + k, line_width, compress,
+				 dna_bufs[t], thread_errmsg))
+			continue;
+#ifdef _OPENMP
+		#pragma omp critical
+#endif
+		{
+			if (ok)
+				strcpy(errmsg, thread_errmsg);
+			ok = 0;
+		}
+	}
+	return ok;
+}
+
+static void free_chunks(struct fasta_chunk *chunks, int nchunk)
+{
+	int k;
+
+	for (k = 0; k < nchunk; k++) {
+		free(chunks[k].out);
+		chunks[k].out = NULL;
+	}
+	return;
+}
+
+/* --- .Call ENTRY POINT --- */
+SEXP C_twobit_to_fasta(SEXP filepath, SEXP destpath, SEXP line_width,
+		       SEXP compress, SEXP nthreads)
+{
+	struct twoBitFile *tbf;
+	const char *dest;
+	int width, nthreads0, chunk_bases, nchunk, batch_size,
+	    batch_start, batch_end, k, t, ok;
+	struct fasta_chunk *chunks;
+	struct twoBitReader **readers;
+	char **dna_bufs;
+	FILE *f;
+	char errmsg[sizeof(((struct twoBitReader *) 0)->errMsg) + 300];
+
+	tbf = _open_2bit_file(filepath);
+	dest = _filepath2str(destpath);
+	width = INTEGER(line_width)[0];
+
+	/* A whole number of lines if they are short enough. Longer lines
+	   span several chunks, so the decoding buffers don't grow with
+	   'line.width'. */
+	chunk_bases = width >= CHUNK_MIN_BASES ?
+		      CHUNK_MIN_BASES : (CHUNK_MIN_BASES / width + 1) * width;
+	chunks = make_fasta_chunks(tbf, chunk_bases, &nchunk);
+	nthreads0 = _get_nthreads(nthreads, nchunk);
+
+	f = fopen(dest, "wb");
+	if (f == NULL) {
+		_close_2bit_file(filepath, &tbf);
+		error("cannot open %s to write: %s", dest, strerror(errno));
+	}
+
+	readers = _new_twoBitReaders(tbf, nthreads0);
+	dna_bufs = (char **) R_alloc(nthreads0, sizeof(char *));
+	for (t = 0; t < nthreads0; t++)
+		dna_bufs[t] = R_alloc(chunk_bases, sizeof(char));
+	batch_size = nthreads0 * BATCH_CHUNKS_PER_THREAD;
+	ok = 1;
+	for (batch_start = 0; batch_start < nchunk; batch_start = batch_end) {
+		batch_end = batch_start + batch_size;
+		if (batch_end > nchunk)
+			batch_end = nchunk;
+		ok = format_chunks(readers, dna_bufs, nthreads0,
+				   chunks + batch_start,
+				   batch_end - batch_start,
+				   width, LOGICAL(compress)[0], errmsg);
+		/* Write the chunks of the batch in order. */
+		for (k = batch_start; ok && k < batch_end; k++) {
+			if (fwrite(chunks[k].out, 1, chunks[k].out_size, f)
+			    != chunks[k].out_size)
+			{
+				snprintf(errmsg, sizeof(errmsg),
+					 "error writing %s: %s",
+					 dest, strerror(errno));
+				ok = 0;
+			}
+		}
+		free_chunks(chunks + batch_start, batch_end - batch_start);
+		if (!ok)
+			break;
+	}
+	_free_twoBitReaders(readers, nthreads0);
+	_close_2bit_file(filepath, &tbf);
+
+	if (fclose(f) != 0 && ok) {
+		snprintf(errmsg, sizeof(errmsg), "error writing %s: %s",
+			 dest, strerror(errno));
+		ok = 0;
+	}
+	if (!ok) {
+		remove(dest);
+		error("%s", errmsg);
+	}
+	return R_NilValue;
+}
@@ -0,0 +1,9 @@
+#ifndef _TWOBIT_TO_FASTA_H_
+#define _TWOBIT_TO_FASTA_H_
+
+#include <Rdefines.h>
+
+SEXP C_twobit_to_fasta(SEXP filepath, SEXP destpath, SEXP line_width,
+		       SEXP compress, SEXP nthreads);
+
+#endif  /* _TWOBIT_TO_FASTA_H_ */